@@ -3,14 +3,60 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/component_wise.hpp>
 
+#include <limits>
+
 struct AABB {
-	glm::vec3 Max;
-	glm::vec3 Min;
+	glm::vec3 Max = glm::vec3(-std::numeric_limits<float>::max());
+	glm::vec3 Min = glm::vec3(std::numeric_limits<float>::max());
 
 	AABB() = default;
 	AABB(const glm::vec3& max, const glm::vec3& min)
 		: Max(max), Min(min) {}
 
+	void Grow(const glm::vec3& point) {
+		Min = glm::min(Min, point);
+		Max = glm::max(Max, point);
+	}
+
+	void Grow(const AABB& other) {
+		Min = glm::min(Min, other.Min);
+		Max = glm::max(Max, other.Max);
+	}
+
+	// Shrinks the box to its overlap with other. The result is empty when they do not touch.
+	void Clip(const AABB& other) {
+		Min = glm::max(Min, other.Min);
+		Max = glm::min(Max, other.Max);
+	}
+
+	bool IsEmpty() const {
+		return Min.x > Max.x || Min.y > Max.y || Min.z > Max.z;
+	}
+
+	glm::vec3 GetCenter() const { return (Min + Max) * 0.5f; }
+
+	// Surface area used by the SAH cost model. An empty box has no area.
+	float SurfaceArea() const {
+		if (IsEmpty())
+			return 0.0f;
+		glm::vec3 extent = Max - Min;
+		return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+	}
+
+	// Slab test against a ray with a precomputed inverse direction. Returns the entry
+	// distance, or FLT_MAX if the box is missed or lies beyond tMax.
+	float IntersectDistance(const glm::vec3& origin, const glm::vec3& invDirection, float tMax) const {
+		glm::vec3 t1 = (Min - origin) * invDirection;
+		glm::vec3 t2 = (Max - origin) * invDirection;
+
+		float tNear = glm::compMax(glm::min(t1, t2));
+		float tFar = glm::compMin(glm::max(t1, t2));
+
+		if (tNear <= tFar && tFar >= 0.0f && tNear < tMax)
+			return tNear;
+		return std::numeric_limits<float>::max();
+	}
+
 	bool IntersectsWithRay(glm::vec3 origin, glm::vec3 direction) const {
 		glm::vec3 invDir = 1.0f / direction;
 		glm::vec3 t1 = (Min - origin) * invDir;
@@ -21,4 +67,4 @@ struct AABB {
 
 		return tNear <= tFar && tFar >= 0;
 	}
-};
\ No newline at end of file
+};
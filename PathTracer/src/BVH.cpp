@@ -0,0 +1,177 @@
+#include "BVH.h"
+#include "BVHTraversal.h"
+
+#include <algorithm>
+
+void BVH::Build(const std::vector<glm::vec3>& corners, const BVHBuildSettings& settings) {
+	std::vector<BVHPrimitive> primitives(corners.size() / 3);
+	for (uint32_t i = 0; i < primitives.size(); i++)
+	{
+		BVHPrimitive& primitive = primitives[i];
+		primitive.Bounds.Grow(corners[i * 3]);
+		primitive.Bounds.Grow(corners[i * 3 + 1]);
+		primitive.Bounds.Grow(corners[i * 3 + 2]);
+		primitive.Centroid = (corners[i * 3] + corners[i * 3 + 1] + corners[i * 3 + 2]) / 3.0f;
+	}
+
+	m_Settings = settings;
+	BVHBuilder builder(settings);
+	if (settings.SplitMethod == BVHSplitMethod::SBVH) {
+		builder.Build(primitives, m_Nodes, m_TriangleOrder, &corners);
+
+		// Build the plain SAH tree as well so the gain of the spatial splits can be reported.
+		BVHBuildSettings objectSplitSettings = settings;
+		objectSplitSettings.SplitMethod = BVHSplitMethod::SAH;
+		BVHNodeArray objectSplitNodes;
+		std::vector<uint32_t> objectSplitOrder;
+		BVHBuilder(objectSplitSettings).Build(primitives, objectSplitNodes, objectSplitOrder);
+		m_ObjectSplitSAHCost = BVHBuilder::CalculateSAHCost(objectSplitNodes, settings);
+	}
+	else {
+		builder.Build(primitives, m_Nodes, m_TriangleOrder);
+		m_ObjectSplitSAHCost = 0.0f;
+	}
+
+	m_ReferenceCount = (uint32_t)m_TriangleOrder.size();
+	AlignLeaves();
+
+	m_SAHCost = BVHBuilder::CalculateSAHCost(m_Nodes, settings);
+	m_BuildSAHCost = m_SAHCost;
+}
+
+void BVH::AlignLeaves() {
+	// The leaf kernels test whole triangle groups. A leaf that straddles more groups than its
+	// size needs, like two triangles in lanes 3 and 0 of two groups, costs an extra SSE test
+	// or an AVX2 test instead of an SSE one. Such leaves start at the next group instead.
+	std::vector<uint32_t> leaves;
+	for (uint32_t i = 0; i < m_Nodes.size(); i++)
+	{
+		if (m_Nodes[i].IsLeaf())
+			leaves.push_back(i);
+	}
+	std::sort(leaves.begin(), leaves.end(), [&](uint32_t a, uint32_t b) { return m_Nodes[a].LeftFirst < m_Nodes[b].LeftFirst; });
+
+	std::vector<uint32_t> order;
+	for (uint32_t leafIndex : leaves)
+	{
+		BVHNode& leaf = m_Nodes[leafIndex];
+		uint32_t lane = (uint32_t)order.size() % TriangleGroupSize;
+		uint32_t groupCount = (lane + leaf.TriangleCount + TriangleGroupSize - 1) / TriangleGroupSize;
+		if (lane > 0 && groupCount > (leaf.TriangleCount + TriangleGroupSize - 1) / TriangleGroupSize)
+			order.resize(order.size() + TriangleGroupSize - lane, PaddingTriangle);
+
+		uint32_t first = (uint32_t)order.size();
+		order.insert(order.end(), m_TriangleOrder.begin() + leaf.LeftFirst, m_TriangleOrder.begin() + leaf.LeftFirst + leaf.TriangleCount);
+		leaf.LeftFirst = first;
+	}
+	order.shrink_to_fit();
+	m_TriangleOrder = std::move(order);
+}
+
+float BVH::Refit(const std::vector<glm::vec3>& corners) {
+	// Children always come after their parent, so walking backwards visits them first.
+	for (size_t i = m_Nodes.size(); i-- > 0;)
+	{
+		BVHNode& node = m_Nodes[i];
+		node.BoundingBox = AABB();
+		if (node.IsLeaf()) {
+			for (uint32_t k = node.LeftFirst; k < node.LeftFirst + node.TriangleCount; k++)
+			{
+				node.BoundingBox.Grow(corners[k * 3]);
+				node.BoundingBox.Grow(corners[k * 3 + 1]);
+				node.BoundingBox.Grow(corners[k * 3 + 2]);
+			}
+		}
+		else {
+			node.BoundingBox.Grow(m_Nodes[node.LeftFirst].BoundingBox);
+			node.BoundingBox.Grow(m_Nodes[node.LeftFirst + 1].BoundingBox);
+		}
+	}
+
+	m_SAHCost = BVHBuilder::CalculateSAHCost(m_Nodes, m_Settings);
+	return m_SAHCost;
+}
+
+bool BVH::Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+	bool hit = false;
+	TraverseBVH(m_Nodes, ray, hitDistance,
+		[&](const BVHNode& leaf) {
+			hit |= triangles.IntersectRange(leaf.LeftFirst, leaf.TriangleCount, ray, hitDistance, triangleIndex, barycentrics);
+			return false;
+		});
+	return hit;
+}
+
+bool BVH::Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const {
+	bool occluded = false;
+	TraverseBVH(m_Nodes, ray, tMax,
+		[&](const BVHNode& leaf) {
+			occluded = triangles.OccludedRange(leaf.LeftFirst, leaf.TriangleCount, ray, tMax);
+			return occluded;
+		});
+	return occluded;
+}
+
+template<uint32_t Width>
+uint32_t BVH::IntersectPacket(const RayPacket<Width>& packet, const TriangleBuffer& triangles, float* hitDistance, uint32_t* triangleIndex, glm::vec2* barycentrics) const {
+	uint32_t hitMask = 0;
+	auto intersectLeaf = [&](const BVHNode& leaf, uint32_t lane) {
+		if (triangles.IntersectRange(leaf.LeftFirst, leaf.TriangleCount, packet.Rays[lane], hitDistance[lane], triangleIndex[lane], barycentrics[lane]))
+			hitMask |= 1u << lane;
+	};
+
+	TraverseBVHPacket(m_Nodes, packet.Rays[std::countr_zero(packet.ActiveMask)], packet.ActiveMask,
+		[&](const BVHNode& node, uint32_t mask) {
+			return IntersectBox(node.BoundingBox, packet, hitDistance, mask);
+		},
+		[&](const BVHNode& leaf, uint32_t mask) {
+			for (; mask; mask &= mask - 1)
+				intersectLeaf(leaf, (uint32_t)std::countr_zero(mask));
+		},
+		[&](uint32_t lane, uint32_t nodeIndex) {
+			TraverseBVH(m_Nodes, packet.Rays[lane], hitDistance[lane],
+				[&](const BVHNode& leaf) {
+					intersectLeaf(leaf, lane);
+					return false;
+				}, nodeIndex);
+		});
+	return hitMask;
+}
+
+template uint32_t BVH::IntersectPacket<4>(const RayPacket<4>&, const TriangleBuffer&, float*, uint32_t*, glm::vec2*) const;
+template uint32_t BVH::IntersectPacket<8>(const RayPacket<8>&, const TriangleBuffer&, float*, uint32_t*, glm::vec2*) const;
+
+size_t BVH::GetPointerTreeMemoryUsage() const {
+	// Layout of the node this class replaced: bounds, two child pointers, a triangle
+	// vector holding a copy of every triangle below the node and a leaf flag.
+	struct Triangle {
+		Vertex A;
+		Vertex B;
+		Vertex C;
+		glm::vec3 Center;
+	};
+	struct PointerNode {
+		AABB BoundingBox;
+		PointerNode* Left;
+		PointerNode* Right;
+		std::vector<Triangle> Triangles;
+		bool IsLeaf;
+	};
+
+	if (m_Nodes.empty())
+		return 0;
+
+	// Children always come after their parent, so walking backwards sums subtree sizes bottom-up.
+	std::vector<uint32_t> triangleCount(m_Nodes.size());
+	size_t bytes = m_Nodes.size() * sizeof(PointerNode);
+	for (size_t i = m_Nodes.size(); i-- > 0;)
+	{
+		const BVHNode& node = m_Nodes[i];
+		if (node.IsLeaf())
+			triangleCount[i] = node.TriangleCount;
+		else
+			triangleCount[i] = triangleCount[node.LeftFirst] + triangleCount[node.LeftFirst + 1];
+		bytes += triangleCount[i] * sizeof(Triangle);
+	}
+	return bytes;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "BVHBuilder.h"
+#include "Triangle.h"
+#include "Ray.h"
+#include "RayPacket.h"
+
+#include <limits>
+#include <vector>
+
+// Per mesh BVH stored as one contiguous node array. Leaves reference contiguous ranges of
+// the triangle order, so the mesh stores its triangles in that order.
+class BVH {
+public:
+	BVH() = default;
+
+	// corners holds the three corners of every triangle.
+	void Build(const std::vector<glm::vec3>& corners, const BVHBuildSettings& settings);
+
+	const BVHNodeArray& GetNodes() const { return m_Nodes; }
+	const BVHNode& GetRoot() const { return m_Nodes[0]; }
+	bool IsEmpty() const { return m_Nodes.empty(); }
+
+	float GetSAHCost() const { return m_SAHCost; }
+	// Cost right after the last full build, refits are compared against it.
+	float GetBuildSAHCost() const { return m_BuildSAHCost; }
+	// SBVH only: cost of the plain SAH tree over the same triangles, 0 for other methods.
+	float GetObjectSplitSAHCost() const { return m_ObjectSplitSAHCost; }
+	// Original index of every triangle, in the order the BVH stores them. With SBVH a
+	// triangle can appear more than once. Slots between leaves hold PaddingTriangle.
+	const std::vector<uint32_t>& GetTriangleOrder() const { return m_TriangleOrder; }
+	// Triangle references of the leaves, without the padding.
+	uint32_t GetReferenceCount() const { return m_ReferenceCount; }
+	// Frees the triangle order once nothing needs to map back to the input triangles.
+	void ReleaseTriangleOrder() { m_TriangleOrder = std::vector<uint32_t>(); }
+
+	// Recomputes the node bounds bottom-up after the triangles moved, keeping the topology.
+	// corners are in the triangle order of the last build, three per entry. Returns the new SAH cost.
+	float Refit(const std::vector<glm::vec3>& corners);
+
+	// Closest hit traversal. hitDistance acts as tMax on input and is only written,
+	// together with triangleIndex, when a closer triangle is found.
+	bool Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const;
+	// Any hit traversal, stops at the first triangle hit closer than tMax.
+	bool Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const;
+
+	// Closest hits of the active rays of a packet, hitDistance and triangleIndex hold one
+	// entry per lane. Returns the lanes that found a closer hit.
+	template<uint32_t Width>
+	uint32_t IntersectPacket(const RayPacket<Width>& packet, const TriangleBuffer& triangles, float* hitDistance, uint32_t* triangleIndex, glm::vec2* barycentrics) const;
+
+	// Bytes used by the node array.
+	size_t GetMemoryUsage() const { return m_Nodes.capacity() * sizeof(BVHNode); }
+	// Bytes the same tree took as heap allocated nodes that each copied their triangles.
+	size_t GetPointerTreeMemoryUsage() const;
+
+	static constexpr uint32_t PaddingTriangle = std::numeric_limits<uint32_t>::max();
+private:
+	void AlignLeaves();
+private:
+	BVHNodeArray m_Nodes;
+	std::vector<uint32_t> m_TriangleOrder;
+	uint32_t m_ReferenceCount = 0;
+	BVHBuildSettings m_Settings;
+	float m_SAHCost = 0.0f;
+	float m_BuildSAHCost = 0.0f;
+	float m_ObjectSplitSAHCost = 0.0f;
+};
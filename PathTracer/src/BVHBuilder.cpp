@@ -0,0 +1,788 @@
+#include "BVHBuilder.h"
+
+#include "Morton.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <bit>
+#include <execution>
+
+BVHBuilder::BVHBuilder(const BVHBuildSettings& settings)
+	: m_Settings(settings) {
+	// Leaves store their primitive count in 16 bits.
+	m_Settings.MaxTrianglesInLeaf = std::clamp(m_Settings.MaxTrianglesInLeaf, 1u, 0xFFFFu);
+	m_Settings.BinCount = std::max(m_Settings.BinCount, 2u);
+}
+
+void BVHBuilder::Build(const std::vector<BVHPrimitive>& primitives, BVHNodeArray& outNodes, std::vector<uint32_t>& outOrder,
+	const std::vector<glm::vec3>* triangleVertices) {
+	outNodes.clear();
+	outOrder.clear();
+	if (primitives.empty())
+		return;
+
+	m_Primitives = &primitives;
+	m_Order.resize(primitives.size());
+	for (uint32_t i = 0; i < primitives.size(); i++)
+		m_Order[i] = i;
+
+	// A binary tree over N primitives never needs more than 2N - 1 nodes.
+	m_Nodes.clear();
+	m_Nodes.resize(primitives.size() * 2 - 1);
+	m_NodesUsed = 1;
+	if (m_Settings.SplitMethod == BVHSplitMethod::LBVH) {
+		SortByMortonCode();
+		SubdivideMorton(0, 0, (uint32_t)primitives.size(), 0);
+		m_MortonCodes.clear();
+		m_MortonCodes.shrink_to_fit();
+	}
+	else if (m_Settings.SplitMethod == BVHSplitMethod::SBVH) {
+		// Every duplicated reference adds one leaf slot and at most two nodes.
+		uint32_t maxDuplicates = (uint32_t)(primitives.size() * std::max(m_Settings.SpatialSplitBudget, 0.0f));
+		m_Nodes.resize((primitives.size() + maxDuplicates) * 2 - 1);
+		m_Order.resize(primitives.size() + maxDuplicates);
+		m_ReferencesUsed = 0;
+		m_DuplicatesLeft = maxDuplicates;
+		m_TriangleVertices = triangleVertices;
+
+		std::vector<Reference> references(primitives.size());
+		AABB rootBounds;
+		for (uint32_t i = 0; i < primitives.size(); i++)
+		{
+			references[i] = { primitives[i].Bounds, i };
+			rootBounds.Grow(primitives[i].Bounds);
+		}
+		m_RootArea = rootBounds.SurfaceArea();
+		SubdivideSpatial(0, references, 0);
+
+		m_Order.resize(m_ReferencesUsed);
+		m_Order.shrink_to_fit();
+		m_TriangleVertices = nullptr;
+	}
+	else {
+		Subdivide(0, 0, (uint32_t)primitives.size(), 0);
+	}
+
+	m_Nodes.resize(m_NodesUsed);
+	m_Nodes.shrink_to_fit();
+	ReorderNodes(m_Nodes, m_Settings.NodeOrder, m_Settings.TreeletSize);
+	outNodes = std::move(m_Nodes);
+	outOrder = std::move(m_Order);
+	m_Primitives = nullptr;
+}
+
+float BVHBuilder::CalculateSAHCost(const BVHNodeArray& nodes, const BVHBuildSettings& settings) {
+	if (nodes.empty())
+		return 0.0f;
+
+	float rootArea = nodes[0].BoundingBox.SurfaceArea();
+	if (rootArea <= 0.0f)
+		return 0.0f;
+
+	float cost = 0.0f;
+	for (const BVHNode& node : nodes)
+	{
+		float probability = node.BoundingBox.SurfaceArea() / rootArea;
+		if (node.IsLeaf())
+			cost += probability * settings.IntersectionCost * node.TriangleCount;
+		else
+			cost += probability * settings.TraversalCost;
+	}
+	return cost;
+}
+
+// Appends the top levels of the subtree below pair in van Emde Boas order: the upper half of
+// the levels first, then every subtree hanging below it. The pairs right below the emitted
+// levels are added to frontier.
+static void VanEmdeBoasOrder(const BVHNodeArray& nodes, uint32_t pair, uint32_t levels,
+	std::vector<uint32_t>& frontier, std::vector<uint32_t>& outPairs) {
+	if (levels <= 1) {
+		outPairs.push_back(pair);
+		for (uint32_t side = 0; side < 2; side++)
+			if (!nodes[pair + side].IsLeaf())
+				frontier.push_back(nodes[pair + side].LeftFirst);
+		return;
+	}
+
+	uint32_t topLevels = levels / 2;
+	std::vector<uint32_t> middle;
+	VanEmdeBoasOrder(nodes, pair, topLevels, middle, outPairs);
+	for (uint32_t bottomPair : middle)
+		VanEmdeBoasOrder(nodes, bottomPair, levels - topLevels, frontier, outPairs);
+}
+
+void BVHBuilder::ReorderNodes(BVHNodeArray& nodes, BVHNodeOrder order, uint32_t treeletSize) {
+	if (order == BVHNodeOrder::Build || nodes.size() < 3)
+		return;
+
+	// Sibling pairs move as a unit and are named by the index of their left node. The root
+	// is alone and stays at index 0.
+	std::vector<uint32_t> pairs;
+	pairs.reserve(nodes.size() / 2);
+	switch (order) {
+	case BVHNodeOrder::DepthFirst: {
+		std::vector<uint32_t> stack = { nodes[0].LeftFirst };
+		while (!stack.empty()) {
+			uint32_t pair = stack.back();
+			stack.pop_back();
+			pairs.push_back(pair);
+			// Push the right side first so the left subtree is emitted next.
+			for (int side = 1; side >= 0; side--)
+				if (!nodes[pair + side].IsLeaf())
+					stack.push_back(nodes[pair + side].LeftFirst);
+		}
+		break;
+	}
+	case BVHNodeOrder::VanEmdeBoas: {
+		// Height in pairs below every node, children come after their parents.
+		std::vector<uint32_t> height(nodes.size(), 0);
+		for (size_t i = nodes.size(); i-- > 0;)
+		{
+			if (!nodes[i].IsLeaf())
+				height[i] = 1 + std::max(height[nodes[i].LeftFirst], height[nodes[i].LeftFirst + 1]);
+		}
+		std::vector<uint32_t> frontier;
+		VanEmdeBoasOrder(nodes, nodes[0].LeftFirst, height[0], frontier, pairs);
+		break;
+	}
+	case BVHNodeOrder::Treelet: {
+		// Grow each block from its root by always adding the pair with the largest surface
+		// area, which is the one a random ray most likely visits. Pairs that do not fit
+		// start their own blocks.
+		uint32_t pairsPerTreelet = std::max(treeletSize / (uint32_t)(2 * sizeof(BVHNode)), 1u);
+		auto pairArea = [&](uint32_t pair) {
+			AABB bounds = nodes[pair].BoundingBox;
+			bounds.Grow(nodes[pair + 1].BoundingBox);
+			return bounds.SurfaceArea();
+		};
+		std::vector<uint32_t> roots = { nodes[0].LeftFirst };
+		std::vector<std::pair<float, uint32_t>> candidates;
+		while (!roots.empty()) {
+			candidates.assign(1, { pairArea(roots.back()), roots.back() });
+			roots.pop_back();
+			for (uint32_t i = 0; i < pairsPerTreelet && !candidates.empty(); i++)
+			{
+				std::pop_heap(candidates.begin(), candidates.end());
+				uint32_t pair = candidates.back().second;
+				candidates.pop_back();
+				pairs.push_back(pair);
+				for (uint32_t side = 0; side < 2; side++)
+				{
+					if (nodes[pair + side].IsLeaf())
+						continue;
+					uint32_t childPair = nodes[pair + side].LeftFirst;
+					candidates.push_back({ pairArea(childPair), childPair });
+					std::push_heap(candidates.begin(), candidates.end());
+				}
+			}
+			for (const auto& candidate : candidates)
+				roots.push_back(candidate.second);
+		}
+		break;
+	}
+	default:
+		return;
+	}
+
+	std::vector<uint32_t> newIndex(nodes.size());
+	BVHNodeArray reordered(nodes.size());
+	reordered[0] = nodes[0];
+	newIndex[0] = 0;
+	uint32_t nodesUsed = 1;
+	for (uint32_t pair : pairs)
+	{
+		newIndex[pair] = nodesUsed;
+		reordered[nodesUsed++] = nodes[pair];
+		reordered[nodesUsed++] = nodes[pair + 1];
+	}
+	for (BVHNode& node : reordered)
+	{
+		if (!node.IsLeaf())
+			node.LeftFirst = newIndex[node.LeftFirst];
+	}
+	nodes = std::move(reordered);
+}
+
+void BVHBuilder::Subdivide(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth) {
+	BVHNode& node = m_Nodes[nodeIndex];
+	node.BoundingBox = CalculateBounds(first, count);
+
+	uint32_t axis = 0;
+	uint32_t leftCount = 0;
+	if (count > 1) {
+		if (NeedsMedianSplit(depth, count))
+			leftCount = count > m_Settings.MaxTrianglesInLeaf ? PartitionAtMedian(first, count, axis) : 0;
+		else if (m_Settings.SplitMethod == BVHSplitMethod::SAH)
+			leftCount = PartitionWithSAH(first, count, node.BoundingBox, axis);
+		else if (count > m_Settings.MaxTrianglesInLeaf)
+			leftCount = PartitionAtMean(first, count, axis);
+
+		// All centroids coincide, split the range in half when it is too big for a leaf.
+		if ((leftCount == 0 || leftCount == count) && count > m_Settings.MaxTrianglesInLeaf)
+			leftCount = count / 2;
+	}
+
+	if (leftCount == 0 || leftCount == count) {
+		node.LeftFirst = first;
+		node.TriangleCount = (uint16_t)count;
+		return;
+	}
+
+	uint32_t leftIndex = AllocateChildren();
+	node.LeftFirst = leftIndex;
+	node.TriangleCount = 0;
+	node.SplitAxis = (uint16_t)axis;
+
+	// Recursively build the left and right child nodes. Both write to disjoint node and
+	// primitive ranges, so big subtrees can be built at the same time.
+	if (IsParallel(count)) {
+		const uint32_t sides[2] = { 0, 1 };
+		std::for_each(std::execution::par, std::begin(sides), std::end(sides),
+			[&](uint32_t side) {
+				if (side == 0)
+					Subdivide(leftIndex, first, leftCount, depth + 1);
+				else
+					Subdivide(leftIndex + 1, first + leftCount, count - leftCount, depth + 1);
+			});
+	}
+	else {
+		Subdivide(leftIndex, first, leftCount, depth + 1);
+		Subdivide(leftIndex + 1, first + leftCount, count - leftCount, depth + 1);
+	}
+}
+
+void BVHBuilder::SortByMortonCode() {
+	const std::vector<BVHPrimitive>& primitives = *m_Primitives;
+	const uint32_t count = (uint32_t)primitives.size();
+
+	AABB centroidBounds;
+	for (const BVHPrimitive& primitive : primitives)
+		centroidBounds.Grow(primitive.Centroid);
+	glm::vec3 scale = 1023.0f / glm::max(centroidBounds.Max - centroidBounds.Min, glm::vec3(1e-20f));
+
+	std::vector<uint32_t> codes(count);
+	std::for_each(std::execution::par, m_Order.begin(), m_Order.end(),
+		[&](uint32_t i) {
+			glm::vec3 cell = glm::clamp((primitives[i].Centroid - centroidBounds.Min) * scale, 0.0f, 1023.0f);
+			codes[i] = MortonCode(glm::uvec3(cell));
+		});
+
+	std::vector<uint32_t> codeScratch, orderScratch;
+	RadixSortByKey(codes, m_Order, codeScratch, orderScratch);
+	m_MortonCodes = std::move(codes);
+}
+
+void BVHBuilder::SubdivideMorton(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth) {
+	if (count <= m_Settings.MaxTrianglesInLeaf) {
+		BVHNode& node = m_Nodes[nodeIndex];
+		node.BoundingBox = CalculateBounds(first, count);
+		node.LeftFirst = first;
+		node.TriangleCount = (uint16_t)count;
+		return;
+	}
+
+	// Split where the highest bit that differs within the range flips. The codes are sorted,
+	// so every primitive with that bit cleared comes first. Equal codes, and ranges close to the
+	// depth limit, are split in half.
+	uint32_t firstCode = m_MortonCodes[first];
+	uint32_t lastCode = m_MortonCodes[first + count - 1];
+	uint32_t leftCount = count / 2;
+	uint32_t axis = 0;
+	if (firstCode != lastCode && !NeedsMedianSplit(depth, count)) {
+		uint32_t bit = 31 - std::countl_zero(firstCode ^ lastCode);
+		auto begin = m_MortonCodes.begin() + first;
+		auto middle = std::partition_point(begin, begin + count, [bit](uint32_t code) { return ((code >> bit) & 1) == 0; });
+		leftCount = (uint32_t)(middle - begin);
+		axis = 2 - bit % 3;
+	}
+
+	uint32_t leftIndex = AllocateChildren();
+	if (IsParallel(count)) {
+		const uint32_t sides[2] = { 0, 1 };
+		std::for_each(std::execution::par, std::begin(sides), std::end(sides),
+			[&](uint32_t side) {
+				if (side == 0)
+					SubdivideMorton(leftIndex, first, leftCount, depth + 1);
+				else
+					SubdivideMorton(leftIndex + 1, first + leftCount, count - leftCount, depth + 1);
+			});
+	}
+	else {
+		SubdivideMorton(leftIndex, first, leftCount, depth + 1);
+		SubdivideMorton(leftIndex + 1, first + leftCount, count - leftCount, depth + 1);
+	}
+
+	// Bounds are merged on the way up instead of scanning the primitives again.
+	BVHNode& node = m_Nodes[nodeIndex];
+	node.BoundingBox = m_Nodes[leftIndex].BoundingBox;
+	node.BoundingBox.Grow(m_Nodes[leftIndex + 1].BoundingBox);
+	node.LeftFirst = leftIndex;
+	node.TriangleCount = 0;
+	node.SplitAxis = (uint16_t)axis;
+}
+
+AABB BVHBuilder::CalculateBounds(uint32_t first, uint32_t count) const {
+	AABB bounds;
+	for (uint32_t i = first; i < first + count; i++)
+		bounds.Grow((*m_Primitives)[m_Order[i]].Bounds);
+	return bounds;
+}
+
+// Bins the centroids along every axis and evaluates the SAH cost at each bin boundary.
+// Returns the number of primitives moved to the left side, 0 if no split beats a leaf.
+uint32_t BVHBuilder::PartitionWithSAH(uint32_t first, uint32_t count, const AABB& bounds, uint32_t& outAxis) {
+	struct Bin {
+		AABB Bounds;
+		uint32_t Count = 0;
+	};
+
+	const std::vector<BVHPrimitive>& primitives = *m_Primitives;
+	const uint32_t binCount = m_Settings.BinCount;
+
+	AABB centroidBounds;
+	for (uint32_t i = first; i < first + count; i++)
+		centroidBounds.Grow(primitives[m_Order[i]].Centroid);
+
+	std::vector<Bin> bins(binCount);
+	std::vector<float> leftArea(binCount - 1), rightArea(binCount - 1);
+	std::vector<uint32_t> leftCount(binCount - 1), rightCount(binCount - 1);
+
+	float bestCost = std::numeric_limits<float>::max();
+	int bestAxis = -1;
+	uint32_t bestSplit = 0;
+
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.Max[axis] - centroidBounds.Min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		std::fill(bins.begin(), bins.end(), Bin());
+		float scale = binCount / extent;
+		for (uint32_t i = first; i < first + count; i++)
+		{
+			const BVHPrimitive& primitive = primitives[m_Order[i]];
+			uint32_t b = std::min(binCount - 1, (uint32_t)((primitive.Centroid[axis] - centroidBounds.Min[axis]) * scale));
+			bins[b].Count++;
+			bins[b].Bounds.Grow(primitive.Bounds);
+		}
+
+		// Sweep from both sides to get the area and count left and right of each plane.
+		AABB leftBox, rightBox;
+		uint32_t leftSum = 0, rightSum = 0;
+		for (uint32_t i = 0; i < binCount - 1; i++)
+		{
+			leftSum += bins[i].Count;
+			leftBox.Grow(bins[i].Bounds);
+			leftCount[i] = leftSum;
+			leftArea[i] = leftBox.SurfaceArea();
+
+			rightSum += bins[binCount - 1 - i].Count;
+			rightBox.Grow(bins[binCount - 1 - i].Bounds);
+			rightCount[binCount - 2 - i] = rightSum;
+			rightArea[binCount - 2 - i] = rightBox.SurfaceArea();
+		}
+
+		for (uint32_t i = 0; i < binCount - 1; i++)
+		{
+			if (leftCount[i] == 0 || rightCount[i] == 0)
+				continue;
+			float cost = leftArea[i] * leftCount[i] + rightArea[i] * rightCount[i];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = i;
+			}
+		}
+	}
+
+	if (bestAxis < 0)
+		return 0;
+
+	float splitCost = m_Settings.TraversalCost + m_Settings.IntersectionCost * bestCost / bounds.SurfaceArea();
+	float leafCost = m_Settings.IntersectionCost * count;
+	if (splitCost >= leafCost && count <= m_Settings.MaxTrianglesInLeaf)
+		return 0;
+
+	outAxis = bestAxis;
+	float minCentroid = centroidBounds.Min[bestAxis];
+	float scale = binCount / (centroidBounds.Max[bestAxis] - minCentroid);
+	auto middle = std::partition(m_Order.begin() + first, m_Order.begin() + first + count,
+		[&](uint32_t index) {
+			uint32_t b = std::min(binCount - 1, (uint32_t)((primitives[index].Centroid[bestAxis] - minCentroid) * scale));
+			return b <= bestSplit;
+		});
+	return (uint32_t)(middle - (m_Order.begin() + first));
+}
+
+uint32_t BVHBuilder::PartitionAtMean(uint32_t first, uint32_t count, uint32_t& outAxis) {
+	const std::vector<BVHPrimitive>& primitives = *m_Primitives;
+
+	// Seeded by the node range, so rebuilding the same mesh gives the same tree.
+	uint32_t splitPlane = (uint32_t)Random(Random::Hash(first) + count).Int(0, 2);
+	float mid = 0.0f;
+	for (uint32_t i = first; i < first + count; i++)
+		mid += primitives[m_Order[i]].Centroid[splitPlane];
+	mid /= (float)count;
+
+	outAxis = splitPlane;
+	auto middle = std::partition(m_Order.begin() + first, m_Order.begin() + first + count,
+		[&](uint32_t index) { return primitives[index].Centroid[splitPlane] < mid; });
+	return (uint32_t)(middle - (m_Order.begin() + first));
+}
+
+// Splits the range in half along the widest extent of its centroids.
+uint32_t BVHBuilder::PartitionAtMedian(uint32_t first, uint32_t count, uint32_t& outAxis) {
+	const std::vector<BVHPrimitive>& primitives = *m_Primitives;
+
+	AABB centroidBounds;
+	for (uint32_t i = first; i < first + count; i++)
+		centroidBounds.Grow(primitives[m_Order[i]].Centroid);
+	glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+	uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+
+	outAxis = axis;
+	auto begin = m_Order.begin() + first;
+	std::nth_element(begin, begin + count / 2, begin + count,
+		[&](uint32_t a, uint32_t b) { return primitives[a].Centroid[axis] < primitives[b].Centroid[axis]; });
+	return count / 2;
+}
+
+// Binned SAH over the centroids of the reference boxes, like PartitionWithSAH.
+BVHBuilder::Split BVHBuilder::FindObjectSplit(const std::vector<Reference>& references) const {
+	struct Bin {
+		AABB Bounds;
+		uint32_t Count = 0;
+	};
+
+	const uint32_t binCount = m_Settings.BinCount;
+
+	AABB centroidBounds;
+	for (const Reference& reference : references)
+		centroidBounds.Grow(reference.Bounds.GetCenter());
+
+	Split best;
+	std::vector<Bin> bins(binCount);
+	std::vector<AABB> rightBounds(binCount);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = centroidBounds.Max[axis] - centroidBounds.Min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		std::fill(bins.begin(), bins.end(), Bin());
+		float scale = binCount / extent;
+		for (const Reference& reference : references)
+		{
+			uint32_t b = std::min(binCount - 1, (uint32_t)((reference.Bounds.GetCenter()[axis] - centroidBounds.Min[axis]) * scale));
+			bins[b].Count++;
+			bins[b].Bounds.Grow(reference.Bounds);
+		}
+
+		AABB rightBox;
+		for (uint32_t i = binCount - 1; i > 0; i--)
+		{
+			rightBox.Grow(bins[i].Bounds);
+			rightBounds[i] = rightBox;
+		}
+
+		AABB leftBox;
+		uint32_t leftCount = 0;
+		for (uint32_t i = 0; i < binCount - 1; i++)
+		{
+			leftBox.Grow(bins[i].Bounds);
+			leftCount += bins[i].Count;
+			uint32_t rightCount = (uint32_t)references.size() - leftCount;
+			if (leftCount == 0 || rightCount == 0)
+				continue;
+
+			float cost = leftBox.SurfaceArea() * leftCount + rightBounds[i + 1].SurfaceArea() * rightCount;
+			if (cost < best.Cost) {
+				best.Cost = cost;
+				best.Axis = axis;
+				best.Bin = i;
+				best.Offset = centroidBounds.Min[axis];
+				best.Scale = scale;
+				best.LeftBounds = leftBox;
+				best.RightBounds = rightBounds[i + 1];
+				best.LeftCount = leftCount;
+				best.RightCount = rightCount;
+			}
+		}
+	}
+	return best;
+}
+
+// Chops the node bounds into equal bins and clips every reference into each bin it spans.
+// A reference is counted where it enters and where it exits, so the counts left and right
+// of a plane include the references the plane would split.
+BVHBuilder::Split BVHBuilder::FindSpatialSplit(const std::vector<Reference>& references, const AABB& bounds) const {
+	struct Bin {
+		AABB Bounds;
+		uint32_t Entries = 0;
+		uint32_t Exits = 0;
+	};
+
+	const uint32_t binCount = m_Settings.BinCount;
+
+	Split best;
+	best.Spatial = true;
+	std::vector<Bin> bins(binCount);
+	std::vector<AABB> rightBounds(binCount);
+	std::vector<uint32_t> rightCounts(binCount);
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float extent = bounds.Max[axis] - bounds.Min[axis];
+		if (extent <= 0.0f)
+			continue;
+
+		std::fill(bins.begin(), bins.end(), Bin());
+		float binSize = extent / binCount;
+		float scale = binCount / extent;
+		for (const Reference& reference : references)
+		{
+			uint32_t firstBin, lastBin;
+			SpatialBinRange(reference, axis, bounds.Min[axis], scale, firstBin, lastBin);
+			for (uint32_t b = firstBin; b <= lastBin; b++)
+			{
+				float binMin = bounds.Min[axis] + b * binSize;
+				float binMax = b == binCount - 1 ? bounds.Max[axis] : binMin + binSize;
+				bins[b].Bounds.Grow(ClipReference(reference, axis, binMin, binMax));
+			}
+			bins[firstBin].Entries++;
+			bins[lastBin].Exits++;
+		}
+
+		AABB rightBox;
+		uint32_t rightCount = 0;
+		for (uint32_t i = binCount - 1; i > 0; i--)
+		{
+			rightBox.Grow(bins[i].Bounds);
+			rightCount += bins[i].Exits;
+			rightBounds[i] = rightBox;
+			rightCounts[i] = rightCount;
+		}
+
+		AABB leftBox;
+		uint32_t leftCount = 0;
+		for (uint32_t i = 0; i < binCount - 1; i++)
+		{
+			leftBox.Grow(bins[i].Bounds);
+			leftCount += bins[i].Entries;
+			if (leftCount == 0 || rightCounts[i + 1] == 0)
+				continue;
+
+			float cost = leftBox.SurfaceArea() * leftCount + rightBounds[i + 1].SurfaceArea() * rightCounts[i + 1];
+			if (cost < best.Cost) {
+				best.Cost = cost;
+				best.Axis = axis;
+				best.Bin = i;
+				best.Offset = bounds.Min[axis];
+				best.Scale = scale;
+				best.LeftBounds = leftBox;
+				best.RightBounds = rightBounds[i + 1];
+				best.LeftCount = leftCount;
+				best.RightCount = rightCounts[i + 1];
+			}
+		}
+	}
+	return best;
+}
+
+// Bounds of the part of a reference between min and max along the axis.
+AABB BVHBuilder::ClipReference(const Reference& reference, int axis, float min, float max) const {
+	AABB clipped;
+	if (m_TriangleVertices) {
+		// Collect the triangle corners inside the slab and the points where its edges cross the slab planes.
+		const glm::vec3* corners = &(*m_TriangleVertices)[reference.Index * 3];
+		for (uint32_t i = 0; i < 3; i++)
+		{
+			const glm::vec3& a = corners[i];
+			const glm::vec3& b = corners[(i + 1) % 3];
+			if (a[axis] >= min && a[axis] <= max)
+				clipped.Grow(a);
+			for (float plane : { min, max })
+			{
+				if ((a[axis] < plane) != (b[axis] < plane)) {
+					glm::vec3 point = glm::mix(a, b, (plane - a[axis]) / (b[axis] - a[axis]));
+					point[axis] = plane;
+					clipped.Grow(point);
+				}
+			}
+		}
+	}
+	else {
+		clipped = reference.Bounds;
+	}
+
+	// The reference may already have been clipped by an earlier split.
+	clipped.Clip(reference.Bounds);
+	clipped.Min[axis] = std::max(clipped.Min[axis], min);
+	clipped.Max[axis] = std::min(clipped.Max[axis], max);
+	return clipped.IsEmpty() ? AABB() : clipped;
+}
+
+void BVHBuilder::SpatialBinRange(const Reference& reference, int axis, float offset, float scale, uint32_t& outFirst, uint32_t& outLast) const {
+	const uint32_t binCount = m_Settings.BinCount;
+	outFirst = std::min(binCount - 1, (uint32_t)std::max(0.0f, (reference.Bounds.Min[axis] - offset) * scale));
+	outLast = std::min(binCount - 1, (uint32_t)std::max(0.0f, (reference.Bounds.Max[axis] - offset) * scale));
+	outLast = std::max(outFirst, outLast);
+}
+
+bool BVHBuilder::ReserveDuplicates(uint32_t count) {
+	if (m_DuplicatesLeft.fetch_sub(count) >= (int64_t)count)
+		return true;
+	m_DuplicatesLeft.fetch_add(count);
+	return false;
+}
+
+void BVHBuilder::SubdivideSpatial(uint32_t nodeIndex, std::vector<Reference>& references, uint32_t depth) {
+	const uint32_t count = (uint32_t)references.size();
+	AABB bounds;
+	for (const Reference& reference : references)
+		bounds.Grow(reference.Bounds);
+
+	// Close to the depth limit the references are halved below, sorted along the widest axis.
+	const bool medianSplit = NeedsMedianSplit(depth, count);
+	Split split = medianSplit ? Split() : FindObjectSplit(references);
+
+	// Spatial splits only pay off where the object split leaves the children overlapping,
+	// and they are limited by the duplicate budget.
+	if (split.Axis >= 0 && m_DuplicatesLeft > 0) {
+		AABB overlap = split.LeftBounds;
+		overlap.Clip(split.RightBounds);
+		if (!overlap.IsEmpty() && overlap.SurfaceArea() > m_Settings.SpatialSplitOverlap * m_RootArea) {
+			Split spatialSplit = FindSpatialSplit(references, bounds);
+			if (spatialSplit.Cost < split.Cost && ReserveDuplicates(spatialSplit.LeftCount + spatialSplit.RightCount - count))
+				split = spatialSplit;
+		}
+	}
+
+	bool makeLeaf = split.Axis < 0;
+	if (!makeLeaf) {
+		float splitCost = m_Settings.TraversalCost + m_Settings.IntersectionCost * split.Cost / bounds.SurfaceArea();
+		float leafCost = m_Settings.IntersectionCost * count;
+		makeLeaf = splitCost >= leafCost && count <= m_Settings.MaxTrianglesInLeaf;
+	}
+
+	std::vector<Reference> left, right;
+	if (!makeLeaf && !split.Spatial) {
+		left.reserve(split.LeftCount);
+		right.reserve(split.RightCount);
+		for (const Reference& reference : references)
+		{
+			uint32_t b = std::min(m_Settings.BinCount - 1, (uint32_t)((reference.Bounds.GetCenter()[split.Axis] - split.Offset) * split.Scale));
+			(b <= split.Bin ? left : right).push_back(reference);
+		}
+	}
+	else if (!makeLeaf) {
+		// Classified by bin exactly like FindSpatialSplit, so no more references get
+		// duplicated than were reserved.
+		const int axis = split.Axis;
+		const float plane = split.Offset + (split.Bin + 1) / split.Scale;
+		AABB leftBounds = split.LeftBounds;
+		AABB rightBounds = split.RightBounds;
+		float leftCount = (float)split.LeftCount;
+		float rightCount = (float)split.RightCount;
+		left.reserve(split.LeftCount);
+		right.reserve(split.RightCount);
+		for (const Reference& reference : references)
+		{
+			uint32_t firstBin, lastBin;
+			SpatialBinRange(reference, axis, split.Offset, split.Scale, firstBin, lastBin);
+			if (lastBin <= split.Bin) {
+				left.push_back(reference);
+				continue;
+			}
+			if (firstBin > split.Bin) {
+				right.push_back(reference);
+				continue;
+			}
+
+			// Moving a straddling reference entirely to one side can be cheaper than duplicating it.
+			AABB grownLeft = leftBounds;
+			grownLeft.Grow(reference.Bounds);
+			AABB grownRight = rightBounds;
+			grownRight.Grow(reference.Bounds);
+			float splitCost = leftBounds.SurfaceArea() * leftCount + rightBounds.SurfaceArea() * rightCount;
+			float leftOnlyCost = grownLeft.SurfaceArea() * leftCount + rightBounds.SurfaceArea() * (rightCount - 1);
+			float rightOnlyCost = leftBounds.SurfaceArea() * (leftCount - 1) + grownRight.SurfaceArea() * rightCount;
+
+			if (leftOnlyCost < splitCost && leftOnlyCost <= rightOnlyCost) {
+				left.push_back(reference);
+				leftBounds = grownLeft;
+				rightCount--;
+			}
+			else if (rightOnlyCost < splitCost) {
+				right.push_back(reference);
+				rightBounds = grownRight;
+				leftCount--;
+			}
+			else {
+				Reference leftPart = { ClipReference(reference, axis, bounds.Min[axis], plane), reference.Index };
+				Reference rightPart = { ClipReference(reference, axis, plane, bounds.Max[axis]), reference.Index };
+				if (!leftPart.Bounds.IsEmpty())
+					left.push_back(leftPart);
+				if (!rightPart.Bounds.IsEmpty())
+					right.push_back(rightPart);
+				if (leftPart.Bounds.IsEmpty() && rightPart.Bounds.IsEmpty())
+					left.push_back(reference);
+			}
+		}
+	}
+
+	// No usable split but too many references for a leaf, split the list in half.
+	if (!makeLeaf && (left.empty() || right.empty())) {
+		std::vector<Reference> all = std::move(left.empty() ? right : left);
+		left.assign(all.begin(), all.begin() + all.size() / 2);
+		right.assign(all.begin() + all.size() / 2, all.end());
+	}
+	else if (makeLeaf && count > m_Settings.MaxTrianglesInLeaf) {
+		if (medianSplit) {
+			AABB centroidBounds;
+			for (const Reference& reference : references)
+				centroidBounds.Grow(reference.Bounds.GetCenter());
+			glm::vec3 extent = centroidBounds.Max - centroidBounds.Min;
+			int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+			std::nth_element(references.begin(), references.begin() + count / 2, references.end(),
+				[axis](const Reference& a, const Reference& b) { return a.Bounds.GetCenter()[axis] < b.Bounds.GetCenter()[axis]; });
+			split.Axis = axis;
+		}
+		left.assign(references.begin(), references.begin() + count / 2);
+		right.assign(references.begin() + count / 2, references.end());
+		makeLeaf = false;
+	}
+
+	if (makeLeaf || left.empty() || right.empty()) {
+		uint32_t first = m_ReferencesUsed.fetch_add(count);
+		for (uint32_t i = 0; i < count; i++)
+			m_Order[first + i] = references[i].Index;
+
+		BVHNode& node = m_Nodes[nodeIndex];
+		node.BoundingBox = bounds;
+		node.LeftFirst = first;
+		node.TriangleCount = (uint16_t)count;
+		return;
+	}
+
+	// The children own their references from here on.
+	references.clear();
+	references.shrink_to_fit();
+
+	uint32_t leftIndex = AllocateChildren();
+	BVHNode& node = m_Nodes[nodeIndex];
+	node.BoundingBox = bounds;
+	node.LeftFirst = leftIndex;
+	node.TriangleCount = 0;
+	node.SplitAxis = (uint16_t)std::max(split.Axis, 0);
+
+	if (IsParallel(count)) {
+		const uint32_t sides[2] = { 0, 1 };
+		std::for_each(std::execution::par, std::begin(sides), std::end(sides),
+			[&](uint32_t side) { SubdivideSpatial(leftIndex + side, side == 0 ? left : right, depth + 1); });
+	}
+	else {
+		SubdivideSpatial(leftIndex, left, depth + 1);
+		SubdivideSpatial(leftIndex + 1, right, depth + 1);
+	}
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "BVHNode.h"
+
+#include <glm/glm.hpp>
+
+#include <atomic>
+#include <bit>
+#include <limits>
+#include <vector>
+
+enum class BVHSplitMethod {
+	Mean, // Random axis, split at the mean of the centroids
+	SAH,  // Binned surface area heuristic
+	LBVH, // Morton code sorted, much faster to build but slower to trace, meant for previews
+	SBVH  // SAH with spatial splits, may reference a primitive from several leaves
+};
+
+// Order of the nodes in the flattened array. Every order keeps sibling pairs next to each
+// other and places children after their parents.
+enum class BVHNodeOrder {
+	Build,       // As allocated, subtrees built in parallel end up interleaved
+	DepthFirst,  // The children of the left child follow right after its sibling pair
+	VanEmdeBoas, // Cache oblivious, the tree is recursively cut at half its height
+	Treelet      // Blocks of TreeletSize bytes, each filled with the pairs most likely to be visited
+};
+
+struct BVHBuildSettings {
+	BVHSplitMethod SplitMethod = BVHSplitMethod::SAH;
+	uint32_t BinCount = 12;
+	uint32_t MaxTrianglesInLeaf = 5;
+	// Cost model: an internal node costs TraversalCost plus the probability
+	// weighted cost of its children, a leaf costs IntersectionCost per triangle.
+	float TraversalCost = 1.0f;
+	float IntersectionCost = 1.0f;
+	// Subtrees with at least this many primitives are built on separate threads, 0 builds serially.
+	uint32_t ParallelThreshold = 4096;
+	// A refit rebuilds the tree once its SAH cost exceeds the built cost by this factor, 0 never rebuilds.
+	float RebuildThreshold = 1.5f;
+	// SBVH: extra primitive references allowed by spatial splits, as a fraction of the primitive count.
+	float SpatialSplitBudget = 0.5f;
+	// SBVH: spatial splits are only tried when the children of the best object split overlap
+	// by more than this fraction of the root surface area.
+	float SpatialSplitOverlap = 1e-5f;
+	// Meshes with at least this many triangles keep their BVH4 / BVH8 with 8 bit child bounds.
+	uint32_t QuantizeTriangleCount = 500000;
+	BVHNodeOrder NodeOrder = BVHNodeOrder::DepthFirst;
+	// Treelet order: bytes per block, e.g. a cache line multiple or a 4 KB page.
+	uint32_t TreeletSize = 4096;
+};
+
+struct BVHPrimitive {
+	AABB Bounds;
+	glm::vec3 Centroid;
+};
+
+// Builds a flattened BVH over arbitrary primitives. The primitives are not moved,
+// the leaves reference ranges of the returned primitive order instead.
+class BVHBuilder {
+public:
+	BVHBuilder(const BVHBuildSettings& settings);
+
+	// SBVH can list a primitive in several leaves, so outOrder may be longer than the input.
+	// Triangle corners (three per primitive) let SBVH clip triangles exactly, without them
+	// the primitive bounds are clipped.
+	void Build(const std::vector<BVHPrimitive>& primitives, BVHNodeArray& outNodes, std::vector<uint32_t>& outOrder,
+		const std::vector<glm::vec3>* triangleVertices = nullptr);
+
+	// Expected cost of tracing a random ray through the tree, relative to the root box.
+	static float CalculateSAHCost(const BVHNodeArray& nodes, const BVHBuildSettings& settings);
+
+	// Rearranges the nodes of a built tree into the given order. The topology, the bounds and
+	// the leaf ranges stay the same.
+	static void ReorderNodes(BVHNodeArray& nodes, BVHNodeOrder order, uint32_t treeletSize);
+private:
+	// Part of a primitive that ended up in a node, its bounds shrink with every spatial split.
+	struct Reference {
+		AABB Bounds;
+		uint32_t Index;
+	};
+
+	struct Split {
+		float Cost = std::numeric_limits<float>::max();
+		int Axis = -1;
+		bool Spatial = false;
+		uint32_t Bin = 0;     // Last bin on the left side
+		float Offset = 0.0f;  // Start of the first bin along the axis
+		float Scale = 0.0f;   // Bins per unit along the axis
+		AABB LeftBounds, RightBounds;
+		uint32_t LeftCount = 0, RightCount = 0;
+	};
+private:
+	void Subdivide(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth);
+	void SubdivideSpatial(uint32_t nodeIndex, std::vector<Reference>& references, uint32_t depth);
+	Split FindObjectSplit(const std::vector<Reference>& references) const;
+	Split FindSpatialSplit(const std::vector<Reference>& references, const AABB& bounds) const;
+	AABB ClipReference(const Reference& reference, int axis, float min, float max) const;
+	void SpatialBinRange(const Reference& reference, int axis, float offset, float scale, uint32_t& outFirst, uint32_t& outLast) const;
+	bool ReserveDuplicates(uint32_t count);
+	void SubdivideMorton(uint32_t nodeIndex, uint32_t first, uint32_t count, uint32_t depth);
+	void SortByMortonCode();
+	uint32_t AllocateChildren() { return m_NodesUsed.fetch_add(2); }
+	bool IsParallel(uint32_t count) const { return m_Settings.ParallelThreshold > 0 && count >= m_Settings.ParallelThreshold; }
+	AABB CalculateBounds(uint32_t first, uint32_t count) const;
+	uint32_t PartitionWithSAH(uint32_t first, uint32_t count, const AABB& bounds, uint32_t& outAxis);
+	uint32_t PartitionAtMean(uint32_t first, uint32_t count, uint32_t& outAxis);
+	uint32_t PartitionAtMedian(uint32_t first, uint32_t count, uint32_t& outAxis);
+	// Halving a node of count primitives reaches single primitive leaves after ceil(log2(count))
+	// levels. Once that would pass BVHMaxDepth the node is split at its median instead of its
+	// best split, which keeps every leaf within the depth the traversal stacks are sized for.
+	static bool NeedsMedianSplit(uint32_t depth, uint32_t count) { return depth + (uint32_t)std::bit_width(count - 1) >= BVHMaxDepth; }
+private:
+	BVHBuildSettings m_Settings;
+
+	const std::vector<BVHPrimitive>* m_Primitives = nullptr;
+	BVHNodeArray m_Nodes;
+	std::vector<uint32_t> m_Order;
+	std::vector<uint32_t> m_MortonCodes; // Sorted, parallel to m_Order, LBVH only
+	std::atomic<uint32_t> m_NodesUsed = 0;
+
+	// SBVH only
+	const std::vector<glm::vec3>* m_TriangleVertices = nullptr;
+	std::atomic<uint32_t> m_ReferencesUsed = 0;
+	std::atomic<int64_t> m_DuplicatesLeft = 0;
+	float m_RootArea = 0.0f;
+};
@@ -1,146 +1,59 @@
 #pragma once
 
-#include "Triangle.h"
 #include "AABB.h"
-#include "Utils.h"
-
-#include <glm/glm.hpp>
 
+#include <cstdint>
+#include <new>
 #include <vector>
 
+// Node of a flattened BVH, 32 bytes so two of them share a cache line.
+// The children of an internal node are stored next to each other, the left one at
+// LeftFirst and the right one at LeftFirst + 1. A leaf references TriangleCount
+// primitives starting at LeftFirst.
 struct BVHNode {
 	AABB BoundingBox;
-	BVHNode* Left = nullptr;
-	BVHNode* Right = nullptr;
-	std::vector<Triangle> Triangles;
-	bool IsLeaf = false;
+	uint32_t LeftFirst = 0;
+	uint16_t TriangleCount = 0;
+	uint16_t SplitAxis = 0;
+
+	bool IsLeaf() const { return TriangleCount > 0; }
 
 	bool Intersects(const glm::vec3& origin, const glm::vec3& direction) const {
 		return BoundingBox.IntersectsWithRay(origin, direction);
 	}
 };
 
-static BVHNode* CreateLeafNode(const std::vector<Triangle>& triangles) {
-	BVHNode* node = new BVHNode;
-	// Compute the bounding box that encloses all triangles in this node.
-	float max = std::numeric_limits<float>::max();
-	float min = std::numeric_limits<float>::min();
-	glm::vec3 minVert = glm::vec3(max, max, max);
-	glm::vec3 maxVert = glm::vec3(-max, -max, -max);
-	for (uint32_t i = 0; i < triangles.size(); i++)
-	{
-		const Triangle& triangle = triangles[i];
-		for (uint32_t j = 0; j < 3; j++)
-		{
-			Vertex vert;
-			if (j == 0)
-				vert = triangle.A;
-			else if (j == 1)
-				vert = triangle.B;
-			else if (j == 2)
-				vert = triangle.C;
-			minVert.x = std::min(minVert.x, vert.Position.x);
-			minVert.y = std::min(minVert.y, vert.Position.y);
-			minVert.z = std::min(minVert.z, vert.Position.z);
-
-			maxVert.x = std::max(maxVert.x, vert.Position.x);
-			maxVert.y = std::max(maxVert.y, vert.Position.y);
-			maxVert.z = std::max(maxVert.z, vert.Position.z);
-		}
-	}
-	node->BoundingBox = AABB(maxVert, minVert);
-	node->IsLeaf = true;
-	node->Triangles = triangles;
-	return node;
-}
-
-// Recursive function to build the BVH.
-static BVHNode* BuildBVH(std::vector<Triangle>& triangles, uint32_t trianglesInLeaf) {
-	if (triangles.size() <= trianglesInLeaf) {
-		return CreateLeafNode(triangles);
-	}
+static_assert(sizeof(BVHNode) == 32, "BVHNode is expected to be 32 bytes");
 
-    BVHNode* node = new BVHNode;
-	node->Triangles = triangles;
+// Deepest level the builder creates, the root is at depth 0. The traversal stacks are sized
+// from it, a stack entry is pushed at most once per level on the way down.
+constexpr uint32_t BVHMaxDepth = 63;
 
-    // Compute the bounding box that encloses all triangles in this node.
-	float max = std::numeric_limits<float>::max();
-	float min = std::numeric_limits<float>::min();
-	glm::vec3 minVert = glm::vec3(max, max, max);
-	glm::vec3 maxVert = glm::vec3(-max, -max, -max);
-	for (uint32_t i = 0; i < triangles.size(); i++)
-	{
-		const Triangle& triangle = triangles[i];
-		for (uint32_t j = 0; j < 3; j++)
-		{
-			Vertex vert;
-			if(j == 0)
-				vert = triangle.A;
-			else if (j == 1)
-				vert = triangle.B;
-			else if (j == 2)
-				vert = triangle.C;
-			minVert.x = std::min(minVert.x, vert.Position.x);
-			minVert.y = std::min(minVert.y, vert.Position.y);
-			minVert.z = std::min(minVert.z, vert.Position.z);
+// Places an array 32 bytes past a cache line boundary. The root is alone at index 0, so every
+// sibling pair then starts at an odd index at the beginning of its own cache line.
+template<typename T>
+struct PairAlignedAllocator {
+	using value_type = T;
+	static constexpr size_t CacheLine = 64;
+	static constexpr size_t Offset = 32;
 
-			maxVert.x = std::max(maxVert.x, vert.Position.x);
-			maxVert.y = std::max(maxVert.y, vert.Position.y);
-			maxVert.z = std::max(maxVert.z, vert.Position.z);
-		}
-	}
-	node->BoundingBox = AABB(maxVert, minVert);
+	PairAlignedAllocator() = default;
+	template<typename U>
+	PairAlignedAllocator(const PairAlignedAllocator<U>&) {}
 
-    // Split the triangles into left and right sets
-	uint32_t splitPlane = Random::Int(0, 2);
-	float midX = 0;
-	float midY = 0;
-	float midZ = 0;
-	for (uint32_t i = 0; i < triangles.size(); i++)
-	{
-		const Triangle& triangle = triangles[i];
-		midX += triangle.Center.x;
-		midY += triangle.Center.y;
-		midZ += triangle.Center.z;
+	T* allocate(size_t count) {
+		char* block = (char*)::operator new(count * sizeof(T) + Offset, std::align_val_t(CacheLine));
+		return (T*)(block + Offset);
 	}
-	midX /= triangles.size();
-	midY /= triangles.size();
-	midZ /= triangles.size();
 
-    std::vector<Triangle> leftTriangles;
-    std::vector<Triangle> rightTriangles;
-	for (uint32_t i = 0; i < triangles.size(); i++)
-	{
-		const Triangle& triangle = triangles[i];
-		if (splitPlane == 0) {
-			if (triangle.Center.x >= midX) {
-				rightTriangles.push_back(triangle);
-			}
-			else {
-				leftTriangles.push_back(triangle);
-			}
-		}
-		if (splitPlane == 1) {
-			if (triangle.Center.y >= midY) {
-				rightTriangles.push_back(triangle);
-			}
-			else {
-				leftTriangles.push_back(triangle);
-			}
-		}
-		if (splitPlane == 2) {
-			if (triangle.Center.z >= midZ) {
-				rightTriangles.push_back(triangle);
-			}
-			else {
-				leftTriangles.push_back(triangle);
-			}
-		}
+	void deallocate(T* pointer, size_t) {
+		::operator delete((char*)pointer - Offset, std::align_val_t(CacheLine));
 	}
 
-    // Recursively build the left and right child nodes.
-	node->Left = BuildBVH(leftTriangles, trianglesInLeaf);
-	node->Right = BuildBVH(rightTriangles, trianglesInLeaf);
+	template<typename U>
+	bool operator==(const PairAlignedAllocator<U>&) const { return true; }
+	template<typename U>
+	bool operator!=(const PairAlignedAllocator<U>&) const { return false; }
+};
 
-    return node;
-}
\ No newline at end of file
+using BVHNodeArray = std::vector<BVHNode, PairAlignedAllocator<BVHNode>>;
@@ -0,0 +1,86 @@
+#include "BVHStats.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+
+static bool SameBounds(const AABB& a, const AABB& b) {
+	return a.Min == b.Min && a.Max == b.Max;
+}
+
+BVHStats BVHStats::Calculate(const BVHNodeArray& nodes, const BVHBuildSettings& settings) {
+	BVHStats stats;
+	if (nodes.empty())
+		return stats;
+
+	stats.NodeCount = (uint32_t)nodes.size();
+	stats.MemoryUsage = nodes.size() * sizeof(BVHNode);
+	stats.SAHCost = BVHBuilder::CalculateSAHCost(nodes, settings);
+	stats.MinLeafSize = std::numeric_limits<uint32_t>::max();
+
+	// Children always come after their parent, so depths can be filled in one forward pass.
+	std::vector<uint32_t> depth(nodes.size(), 0);
+	uint64_t leafDepthSum = 0;
+	uint64_t leafSizeSum = 0;
+	float overlapSum = 0.0f;
+	for (uint32_t i = 0; i < nodes.size(); i++)
+	{
+		const BVHNode& node = nodes[i];
+		stats.MaxDepth = std::max(stats.MaxDepth, depth[i]);
+
+		if (node.BoundingBox.IsEmpty())
+			stats.EmptyNodes++;
+		else if (node.BoundingBox.SurfaceArea() <= 0.0f)
+			stats.DegenerateNodes++;
+
+		if (node.IsLeaf()) {
+			stats.LeafCount++;
+			leafDepthSum += depth[i];
+			leafSizeSum += node.TriangleCount;
+			stats.MinLeafSize = std::min<uint32_t>(stats.MinLeafSize, node.TriangleCount);
+			stats.MaxLeafSize = std::max<uint32_t>(stats.MaxLeafSize, node.TriangleCount);
+			if (stats.LeafSizeHistogram.size() <= node.TriangleCount)
+				stats.LeafSizeHistogram.resize(node.TriangleCount + 1, 0);
+			stats.LeafSizeHistogram[node.TriangleCount]++;
+			continue;
+		}
+
+		const BVHNode& left = nodes[node.LeftFirst];
+		const BVHNode& right = nodes[node.LeftFirst + 1];
+		depth[node.LeftFirst] = depth[i] + 1;
+		depth[node.LeftFirst + 1] = depth[i] + 1;
+
+		// A split that leaves a child as big as its parent did not narrow anything down.
+		if (SameBounds(left.BoundingBox, node.BoundingBox) && SameBounds(right.BoundingBox, node.BoundingBox))
+			stats.DegenerateNodes++;
+
+		float parentArea = node.BoundingBox.SurfaceArea();
+		if (parentArea > 0.0f) {
+			AABB overlap = left.BoundingBox;
+			overlap.Clip(right.BoundingBox);
+			overlapSum += overlap.SurfaceArea() / parentArea;
+		}
+	}
+
+	uint32_t internalCount = stats.NodeCount - stats.LeafCount;
+	stats.AverageLeafDepth = (float)leafDepthSum / stats.LeafCount;
+	stats.AverageLeafSize = (float)leafSizeSum / stats.LeafCount;
+	stats.AverageChildOverlap = internalCount > 0 ? overlapSum / internalCount : 0.0f;
+	return stats;
+}
+
+void BVHStats::Log(const std::string& name) const {
+	spdlog::info("BVH stats ({}): {} nodes, {} leaves, depth {} (leaf average {:.1f}), SAH cost {:.3f}, child overlap {:.3f}",
+		name, NodeCount, LeafCount, MaxDepth, AverageLeafDepth, SAHCost, AverageChildOverlap);
+
+	std::string histogram;
+	for (uint32_t size = 1; size < LeafSizeHistogram.size(); size++)
+	{
+		if (LeafSizeHistogram[size] > 0)
+			histogram += fmt::format(" {}:{}", size, LeafSizeHistogram[size]);
+	}
+	spdlog::info("BVH leaves ({}): {}-{} triangles, average {:.2f}, histogram{}", name, MinLeafSize, MaxLeafSize, AverageLeafSize, histogram);
+
+	if (EmptyNodes > 0 || DegenerateNodes > 0)
+		spdlog::warn("BVH ({}): {} empty and {} degenerate nodes", name, EmptyNodes, DegenerateNodes);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "BVHBuilder.h"
+
+#include <string>
+#include <vector>
+
+// Quality numbers of a built BVH, used to tune the build settings and to catch
+// regressions in the builders.
+struct BVHStats {
+	uint32_t NodeCount = 0;
+	uint32_t LeafCount = 0;
+	uint32_t MaxDepth = 0;
+	float AverageLeafDepth = 0.0f;
+
+	uint32_t MinLeafSize = 0;
+	uint32_t MaxLeafSize = 0;
+	float AverageLeafSize = 0.0f;
+	std::vector<uint32_t> LeafSizeHistogram; // Leaves per triangle count
+
+	uint32_t EmptyNodes = 0;      // Bounds that contain nothing
+	uint32_t DegenerateNodes = 0; // Bounds without surface area, or children with the same bounds as the node
+
+	float SAHCost = 0.0f;
+	// Surface area of the overlap of the two children relative to their parent, averaged over internal nodes.
+	float AverageChildOverlap = 0.0f;
+	size_t MemoryUsage = 0; // Bytes
+
+	static BVHStats Calculate(const BVHNodeArray& nodes, const BVHBuildSettings& settings);
+
+	void Log(const std::string& name) const;
+};
@@ -0,0 +1,183 @@
+#pragma once
+
+#include "BVHNode.h"
+#include "Ray.h"
+
+#include <glm/glm.hpp>
+
+#include <bit>
+#include <cassert>
+#include <limits>
+#include <vector>
+
+constexpr uint32_t BVHMaxStackSize = BVHMaxDepth + 1;
+// Packet traversal finishes subtrees hit by fewer rays than this one ray at a time.
+constexpr uint32_t BVHMinPacketRays = 2;
+
+// Walks a flattened BVH front to back. The child on the near side of the split axis is
+// visited first and nodes that start behind tMax are skipped. intersectLeaf(node) tests
+// the primitives of a leaf, shrinks tMax when it finds a closer hit and returns true to
+// stop the traversal early. rootIndex lets the walk start inside the tree.
+template<typename LeafFunction>
+static void TraverseBVH(const BVHNodeArray& nodes, const Ray& ray, float& tMax, LeafFunction&& intersectLeaf, uint32_t rootIndex = 0) {
+	constexpr float miss = std::numeric_limits<float>::max();
+	const glm::vec3& origin = ray.Origin;
+	const glm::vec3& invDirection = ray.InvDirection;
+	if (nodes.empty() || nodes[rootIndex].BoundingBox.IntersectDistance(origin, invDirection, tMax) == miss)
+		return;
+
+	const uint32_t directionIsNegative[3] = { invDirection.x < 0.0f, invDirection.y < 0.0f, invDirection.z < 0.0f };
+
+	uint32_t stack[BVHMaxStackSize];
+	float stackDistance[BVHMaxStackSize];
+	uint32_t stackSize = 0;
+
+	uint32_t nodeIndex = rootIndex;
+	while (true) {
+		const BVHNode& node = nodes[nodeIndex];
+		if (node.IsLeaf()) {
+			if (intersectLeaf(node))
+				return;
+		}
+		else {
+			// The left child holds the lower half along the split axis, so a ray going in
+			// the negative direction reaches the right child first.
+			uint32_t nearIndex = node.LeftFirst + directionIsNegative[node.SplitAxis];
+			uint32_t farIndex = node.LeftFirst + 1 - directionIsNegative[node.SplitAxis];
+			float nearDistance = nodes[nearIndex].BoundingBox.IntersectDistance(origin, invDirection, tMax);
+			float farDistance = nodes[farIndex].BoundingBox.IntersectDistance(origin, invDirection, tMax);
+
+			if (nearDistance != miss && farDistance != miss) {
+				assert(stackSize < BVHMaxStackSize && "BVH deeper than BVHMaxDepth");
+				stack[stackSize] = farIndex;
+				stackDistance[stackSize] = farDistance;
+				stackSize++;
+				nodeIndex = nearIndex;
+				continue;
+			}
+			if (nearDistance != miss || farDistance != miss) {
+				nodeIndex = nearDistance != miss ? nearIndex : farIndex;
+				continue;
+			}
+		}
+
+		// Pop the next node, skipping the ones that start behind the closest hit so far.
+		bool found = false;
+		while (stackSize > 0) {
+			stackSize--;
+			if (stackDistance[stackSize] < tMax) {
+				nodeIndex = stack[stackSize];
+				found = true;
+				break;
+			}
+		}
+		if (!found)
+			return;
+	}
+}
+
+// Walks a flattened BVH with a packet of rays, entering a node while any ray of mask hits it.
+// Children are visited in the front to back order of leadRay, so the packet should be coherent.
+// intersectBox(node, mask) returns the lanes of mask that hit the node, intersectLeaf(node, mask)
+// tests the leaf for those lanes. Subtrees left with fewer than BVHMinPacketRays rays are handed
+// to traceSingle(lane, nodeIndex) for every remaining lane.
+template<typename BoxFunction, typename LeafFunction, typename SingleFunction>
+static void TraverseBVHPacket(const BVHNodeArray& nodes, const Ray& leadRay, uint32_t mask,
+	BoxFunction&& intersectBox, LeafFunction&& intersectLeaf, SingleFunction&& traceSingle) {
+	if (nodes.empty() || mask == 0)
+		return;
+
+	const glm::vec3& invDirection = leadRay.InvDirection;
+	const uint32_t directionIsNegative[3] = { invDirection.x < 0.0f, invDirection.y < 0.0f, invDirection.z < 0.0f };
+
+	struct StackEntry {
+		uint32_t Node;
+		uint32_t Mask;
+	};
+	// Every level pops its node and pushes both children, one entry more per level than the root.
+	StackEntry stack[BVHMaxDepth + 1];
+	uint32_t stackSize = 0;
+	stack[stackSize++] = { 0, mask };
+
+	while (stackSize > 0) {
+		// The box is tested when popped, so lanes that found a closer hit meanwhile drop out.
+		const StackEntry entry = stack[--stackSize];
+		uint32_t active = intersectBox(nodes[entry.Node], entry.Mask);
+		if (active == 0)
+			continue;
+
+		if ((uint32_t)std::popcount(active) < BVHMinPacketRays) {
+			while (active) {
+				traceSingle((uint32_t)std::countr_zero(active), entry.Node);
+				active &= active - 1;
+			}
+			continue;
+		}
+
+		const BVHNode& node = nodes[entry.Node];
+		if (node.IsLeaf()) {
+			intersectLeaf(node, active);
+			continue;
+		}
+
+		assert(stackSize + 2 <= BVHMaxDepth + 1 && "BVH deeper than BVHMaxDepth");
+		stack[stackSize++] = { node.LeftFirst + 1 - directionIsNegative[node.SplitAxis], active };
+		stack[stackSize++] = { node.LeftFirst + directionIsNegative[node.SplitAxis], active };
+	}
+}
+
+// Walks a wide BVH nearest child first, starting at node 0. intersectChildren(node, tMax, distances)
+// returns a bit mask of the children hit in front of tMax and writes their entry distances.
+// intersectLeaf(first, count) tests a leaf's triangles, shrinks tMax on a closer hit and
+// returns true to stop the traversal early.
+template<uint32_t Width, typename Node, typename ChildFunction, typename LeafFunction>
+static void TraverseWideBVH(const std::vector<Node>& nodes, float& tMax, ChildFunction&& intersectChildren, LeafFunction&& intersectLeaf) {
+	if (nodes.empty())
+		return;
+
+	struct StackEntry {
+		uint32_t Child;
+		uint32_t Count;
+		float Distance;
+	};
+	// A wide node replaces its binary node and descendants, so the wide tree is no deeper than
+	// BVHMaxDepth either. Every level pops its node and pushes at most Width children.
+	constexpr uint32_t StackSize = BVHMaxDepth * (Width - 1) + 1;
+	StackEntry stack[StackSize];
+	uint32_t stackSize = 0;
+	stack[stackSize++] = { 0, 0, -std::numeric_limits<float>::max() };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (entry.Distance >= tMax)
+			continue;
+
+		if (entry.Count > 0) {
+			if (intersectLeaf(entry.Child, entry.Count))
+				return;
+			continue;
+		}
+
+		const Node& node = nodes[entry.Child];
+		float distances[Width];
+		uint32_t mask = intersectChildren(node, tMax, distances);
+		assert(stackSize + (uint32_t)std::popcount(mask) <= StackSize && "Wide BVH deeper than BVHMaxDepth");
+
+		// Push the hit children far to near so the nearest one is popped first.
+		const uint32_t first = stackSize;
+		while (mask) {
+			uint32_t i = 0;
+			while (!(mask & (1u << i)))
+				i++;
+			mask &= mask - 1;
+
+			StackEntry child = { node.Child[i], node.Count[i], distances[i] };
+			uint32_t j = stackSize++;
+			while (j > first && stack[j - 1].Distance < child.Distance) {
+				stack[j] = stack[j - 1];
+				j--;
+			}
+			stack[j] = child;
+		}
+	}
+}
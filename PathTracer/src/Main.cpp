@@ -14,6 +14,7 @@
 #include <glm/gtc/type_ptr.hpp>
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
 #include <filesystem>
 
 int main(void)
@@ -68,9 +69,12 @@ int main(void)
 
     //scene.Models.push_back(Model("Models/cornellbox.obj"));
     scene.Models.push_back(Model("Models/monkeys.obj"));
+    scene.AddModelInstance(0);
+    scene.BuildTLAS();
 #pragma endregion
 
     Renderer renderer;
+    BVHBuildSettings bvhSettings;
     Camera camera(45.0f, screenWidth, screenHeight, 0.1f, 100.0f);
     Image image(screenWidth, screenHeight);
     Image accumulationImage(screenWidth, screenHeight);
@@ -84,8 +88,11 @@ int main(void)
         double delta = currTime - prevTime;
         prevTime = currTime;
 
-        /* Poll for and process events */
-        glfwPollEvents();
+        /* Poll for and process events, a finished render only redraws when something happens */
+        if (renderer.IsFinished())
+            glfwWaitEventsTimeout(0.25);
+        else
+            glfwPollEvents();
         
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
@@ -105,8 +112,117 @@ int main(void)
 
         ImGui::Begin("PATH TRACER");
         ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / io.Framerate, io.Framerate);
+        ImGui::Text("Render %.3f ms, %u spp, %.2f Msamples/s, %.2f Mrays/s, %.1f%% converged", renderer.GetStats().FrameTime, renderer.GetStats().SampleCount,
+            renderer.GetStats().MSamplesPerSecond, renderer.GetStats().MRaysPerSecond, renderer.GetStats().ConvergedPixelShare * 100.0f);
+        ImGui::Text("Primary %.2f Mrays/s (%.3f ms, %llu rays outside packets), bounces %.2f Mrays/s", renderer.GetStats().PrimaryMRaysPerSecond,
+            renderer.GetStats().PrimaryTime, (unsigned long long)renderer.GetStats().PacketFallbackCount, renderer.GetStats().SecondaryMRaysPerSecond);
+        const Renderer::Stats& renderStats = renderer.GetStats();
+        if (renderer.IsFinished())
+            ImGui::Text("Finished: %u spp, noise %.4f in %.1f s", renderStats.AccumulatedSampleCount, renderStats.Noise, renderStats.RenderTime);
+        else if (renderStats.EstimatedTimeLeft >= 0.0f)
+            ImGui::Text("%u spp, noise %.4f, %.1f s, %.1f s left", renderStats.AccumulatedSampleCount, renderStats.Noise, renderStats.RenderTime, renderStats.EstimatedTimeLeft);
+        else
+            ImGui::Text("%u spp, noise %.4f, %.1f s", renderStats.AccumulatedSampleCount, renderStats.Noise, renderStats.RenderTime);
+        const std::vector<float>& utilization = renderer.GetStats().ThreadUtilization;
+        ImGui::Text("Tiles %u (%u stolen, %u split) on %zu threads", renderer.GetStats().TileCount, renderer.GetStats().StolenTileCount,
+            renderer.GetStats().SplitTileCount, utilization.size());
+        ImGui::PlotHistogram("Thread utilization", utilization.data(), (int)utilization.size(), 0, nullptr, 0.0f, 1.0f, ImVec2(0.0f, 40.0f));
         ImGui::Checkbox("Accumulate", &renderer.GetSettings().Accumulate);
+        ImGui::SliderFloat("Frame budget (ms)", &renderer.GetSettings().FrameBudget, 0.0f, 100.0f, "%.0f");
+        ImGui::Checkbox("Adaptive sampling", &renderer.GetSettings().AdaptiveSampling);
+        ImGui::SliderFloat("Relative error", &renderer.GetSettings().AdaptiveThreshold, 0.001f, 0.2f, "%.3f", ImGuiSliderFlags_Logarithmic);
+        int minSamples = (int)renderer.GetSettings().AdaptiveMinSamples;
+        if (ImGui::SliderInt("Min samples", &minSamples, 2, 256))
+            renderer.GetSettings().AdaptiveMinSamples = (uint32_t)minSamples;
+        ImGui::InputFloat("Target noise", &renderer.GetSettings().TargetNoise, 0.001f, 0.01f, "%.4f");
+        int targetSamples = (int)renderer.GetSettings().TargetSampleCount;
+        if (ImGui::InputInt("Target spp", &targetSamples, 16, 256))
+            renderer.GetSettings().TargetSampleCount = (uint32_t)std::max(targetSamples, 0);
+        int sampler = (int)renderer.GetSettings().Sampler;
+        if (ImGui::Combo("Sampler", &sampler, "Random\0Stratified\0Sobol\0Blue noise\0")) {
+            renderer.GetSettings().Sampler = (SamplerType)sampler;
+            renderer.ResetFrameIndex();
+        }
+        int seed = (int)renderer.GetSettings().Seed;
+        if (ImGui::InputInt("Seed", &seed)) {
+            renderer.GetSettings().Seed = (uint32_t)seed;
+            renderer.ResetFrameIndex();
+        }
+        int maxDepth = (int)renderer.GetSettings().MaxDepth;
+        if (ImGui::SliderInt("Max depth", &maxDepth, 1, 64)) {
+            renderer.GetSettings().MaxDepth = (uint32_t)maxDepth;
+            renderer.ResetFrameIndex();
+        }
+        ImGui::Checkbox("Russian roulette", &renderer.GetSettings().RussianRoulette);
+        int rouletteMinDepth = (int)renderer.GetSettings().RouletteMinDepth;
+        if (ImGui::SliderInt("Roulette from depth", &rouletteMinDepth, 1, 16))
+            renderer.GetSettings().RouletteMinDepth = (uint32_t)rouletteMinDepth;
+        ImGui::Text("Average path length %.2f rays", renderer.GetStats().AveragePathLength);
+        int view = (int)renderer.GetSettings().View;
+        if (ImGui::Combo("View", &view, "Color\0Samples per pixel\0"))
+            renderer.GetSettings().View = (RenderView)view;
         ImGui::Checkbox("Environment", &renderer.GetSettings().ShowEnvironment);
+        int layout = (int)renderer.GetSettings().Layout;
+        if (ImGui::Combo("BVH", &layout, "Binary\0BVH4 (SSE)\0BVH8 (AVX2)\0"))
+            renderer.GetSettings().Layout = (BVHLayout)layout;
+        int integrator = (int)renderer.GetSettings().Integrator;
+        if (ImGui::Combo("Integrator", &integrator, "Megakernel\0Wavefront\0"))
+            renderer.GetSettings().Integrator = (RenderIntegrator)integrator;
+        if (renderer.GetSettings().Integrator == RenderIntegrator::Wavefront) {
+            ImGui::Checkbox("Sort rays", &renderer.GetSettings().SortRays);
+            ImGui::SameLine();
+            ImGui::Checkbox("Sort hits", &renderer.GetSettings().SortHits);
+            const std::vector<Renderer::Stats::DepthStats>& depths = renderer.GetStats().Depths;
+            for (size_t depth = 0; depth < depths.size() && depths[depth].RayCount > 0; depth++)
+            {
+                float nsPerRay = 1e6f / depths[depth].RayCount;
+                ImGui::Text("Bounce %zu: %llu rays, sort %.0f, extend %.0f, shade %.0f ns/ray, %.0f%% material switches", depth,
+                    (unsigned long long)depths[depth].RayCount, depths[depth].SortTime * nsPerRay, depths[depth].ExtendTime * nsPerRay,
+                    depths[depth].ShadeTime * nsPerRay, depths[depth].MaterialSwitchRate * 100.0f);
+            }
+        }
+        int packetSize = renderer.GetSettings().PacketSize == 8 ? 2 : (renderer.GetSettings().PacketSize == 4 ? 1 : 0);
+        if (ImGui::Combo("Primary packets", &packetSize, "Off\0" "4 rays (SSE)\0" "8 rays (AVX2)\0"))
+            renderer.GetSettings().PacketSize = packetSize == 2 ? 8 : (packetSize == 1 ? 4 : 1);
+        if (ImGui::CollapsingHeader("BVH build")) {
+            int splitMethod = (int)bvhSettings.SplitMethod;
+            if (ImGui::Combo("Method", &splitMethod, "Mean\0SAH\0LBVH\0SBVH\0"))
+                bvhSettings.SplitMethod = (BVHSplitMethod)splitMethod;
+            int nodeOrder = (int)bvhSettings.NodeOrder;
+            if (ImGui::Combo("Node order", &nodeOrder, "Build\0Depth first\0van Emde Boas\0Treelet\0"))
+                bvhSettings.NodeOrder = (BVHNodeOrder)nodeOrder;
+            int trianglesInLeaf = (int)bvhSettings.MaxTrianglesInLeaf;
+            if (ImGui::SliderInt("Triangles in leaf", &trianglesInLeaf, 1, 32))
+                bvhSettings.MaxTrianglesInLeaf = (uint32_t)trianglesInLeaf;
+            if (ImGui::Button("Rebuild")) {
+                for (Model& model : scene.Models)
+                    for (Mesh& mesh : model.GetMeshes())
+                        mesh.RebuildBVH(bvhSettings);
+                scene.BuildTLAS();
+                renderer.ResetFrameIndex();
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Log stats")) {
+                for (const Model& model : scene.Models)
+                    for (const Mesh& mesh : model.GetMeshes())
+                        mesh.GetBVHStats().Log(mesh.GetName());
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("Benchmark leaf kernels")) {
+                for (const Model& model : scene.Models)
+                    for (const Mesh& mesh : model.GetMeshes())
+                        mesh.BenchmarkTriangleKernels();
+            }
+            for (const Model& model : scene.Models)
+            {
+                for (const Mesh& mesh : model.GetMeshes())
+                {
+                    const BVHStats& stats = mesh.GetBVHStats();
+                    ImGui::Text("%s: %u nodes, depth %u, leaves %u-%u (avg %.2f), SAH %.2f, overlap %.3f", mesh.GetName().c_str(),
+                        stats.NodeCount, stats.MaxDepth, stats.MinLeafSize, stats.MaxLeafSize, stats.AverageLeafSize, mesh.GetBVH().GetSAHCost(), stats.AverageChildOverlap);
+                }
+            }
+        }
         if (ImGui::BeginCombo("Choose an Image", scene.EnvironmentImages[scene.SelectedEnvironment].GetName().c_str())) {
             for (int i = 0; i < scene.EnvironmentImages.size(); ++i) {
                 bool isSelected = (i == scene.SelectedEnvironment);
@@ -0,0 +1,50 @@
+#include "Memory.h"
+
+#if defined(_WIN32)
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <fstream>
+#include <string>
+#endif
+
+#if defined(_WIN32)
+static PROCESS_MEMORY_COUNTERS QueryCounters() {
+	PROCESS_MEMORY_COUNTERS counters = {};
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters;
+}
+#else
+// Reads a "Key: value kB" line of /proc/self/status.
+static size_t ReadStatus(const char* key) {
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+	{
+		if (line.rfind(key, 0) == 0)
+			return std::stoull(line.substr(line.find(':') + 1)) * 1024;
+	}
+	return 0;
+}
+#endif
+
+namespace Memory {
+
+	size_t GetCurrentUsage() {
+#if defined(_WIN32)
+		return QueryCounters().WorkingSetSize;
+#else
+		return ReadStatus("VmRSS");
+#endif
+	}
+
+	size_t GetPeakUsage() {
+#if defined(_WIN32)
+		return QueryCounters().PeakWorkingSetSize;
+#else
+		return ReadStatus("VmHWM");
+#endif
+	}
+
+}
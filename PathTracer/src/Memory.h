@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+
+namespace Memory {
+
+	// Resident memory of the process in bytes, 0 where the platform does not report it.
+	size_t GetCurrentUsage();
+	// Highest resident memory since the process started.
+	size_t GetPeakUsage();
+
+}
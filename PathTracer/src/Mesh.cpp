@@ -1,29 +1,270 @@
 #include "Mesh.h"
+#include "SIMD.h"
+#include "Utils.h"
 
-Mesh::Mesh(const std::string& name, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, const Material& material)
-	: m_Name(name), m_Vertices(vertices), m_Indices(indices){
-	CalculateTriangles();
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <limits>
+
+Mesh::Mesh(const std::string& name, std::vector<Vertex> vertices, const std::vector<uint32_t>& indices, const Material& material,
+	const BVHBuildSettings& bvhSettings, MeshStorage storage)
+	: m_Name(name), m_Vertices(std::move(vertices)), m_BVHSettings(bvhSettings) {
+	m_Vertices.shrink_to_fit();
 	m_AABB = CreateAABB();
 	m_Material = material;
-	m_BVHNode = BuildBVH(m_Triangles, 5);
+	BuildBVH(indices);
+
+	// The triangle order is only needed to get the source triangles back for a rebuild.
+	m_Storage = storage;
+	if (storage == MeshStorage::RenderOnly)
+		m_BVH.ReleaseTriangleOrder();
+	LogMemoryUsage();
+}
+
+void Mesh::RebuildBVH(const BVHBuildSettings& settings) {
+	if (!IsEditable()) {
+		spdlog::error("Mesh {}: render only meshes can not rebuild their BVH", m_Name);
+		return;
+	}
+	m_BVHSettings = settings;
+	BuildBVH(CalculateSourceIndices());
+}
+
+void Mesh::BuildBVH(const std::vector<uint32_t>& sourceIndices) {
+	std::vector<glm::vec3> corners = CalculateCorners(sourceIndices);
+	Timer timer;
+	m_BVH.Build(corners, m_BVHSettings);
+	float buildTime = timer.ElapsedMillis();
+	FillTriangles(sourceIndices, corners);
+	size_t triangleCount = m_TriangleCount;
+	spdlog::info("BVH build ({}): {} triangles in {:.2f} ms ({:.1f} ms per million triangles)", m_Name, triangleCount,
+		buildTime, triangleCount == 0 ? 0.0f : buildTime * 1e6f / triangleCount);
+	m_BVHStats = BVHStats::Calculate(m_BVH.GetNodes(), m_BVHSettings);
+	m_BVHStats.Log(m_Name);
+	if (m_BVH.GetObjectSplitSAHCost() > 0.0f) {
+		spdlog::info("SBVH ({}): {:.1f}% lower SAH cost than plain SAH ({:.3f}), {} references for {} triangles", m_Name,
+			100.0f * (1.0f - m_BVH.GetSAHCost() / m_BVH.GetObjectSplitSAHCost()), m_BVH.GetObjectSplitSAHCost(),
+			m_BVH.GetReferenceCount(), triangleCount);
+	}
+	spdlog::info("BVH memory ({}): {} nodes, {:.1f} KB (pointer tree: {:.1f} KB)", m_Name, m_BVH.GetNodes().size(),
+		m_BVH.GetMemoryUsage() / 1024.0f, m_BVH.GetPointerTreeMemoryUsage() / 1024.0f);
+
+	BuildWideBVHs();
+	size_t nodes4 = IsQuantized() ? m_QuantizedBVH4.GetNodes().size() : m_BVH4.GetNodes().size();
+	size_t nodes8 = IsQuantized() ? m_QuantizedBVH8.GetNodes().size() : m_BVH8.GetNodes().size();
+	spdlog::info("BVH4 memory ({}): {} nodes, {:.1f} KB float, {:.1f} KB quantized ({} used)", m_Name, nodes4,
+		nodes4 * sizeof(WideBVHNode<4>) / 1024.0f, nodes4 * sizeof(QuantizedWideBVHNode<4>) / 1024.0f, IsQuantized() ? "quantized" : "float");
+	spdlog::info("BVH8 memory ({}): {} nodes, {:.1f} KB float, {:.1f} KB quantized ({} used)", m_Name, nodes8,
+		nodes8 * sizeof(WideBVHNode<8>) / 1024.0f, nodes8 * sizeof(QuantizedWideBVHNode<8>) / 1024.0f, IsQuantized() ? "quantized" : "float");
+}
+
+void Mesh::BuildWideBVHs() {
+	m_BVH4.Build(m_BVH.GetNodes());
+	m_BVH8.Build(m_BVH.GetNodes());
+	m_QuantizedBVH4 = QuantizedBVH4();
+	m_QuantizedBVH8 = QuantizedBVH8();
+	if (m_TriangleCount < m_BVHSettings.QuantizeTriangleCount)
+		return;
+
+	// The float trees are only needed to build the quantized ones.
+	m_QuantizedBVH4.Build(m_BVH4);
+	m_QuantizedBVH8.Build(m_BVH8);
+	m_BVH4 = BVH4();
+	m_BVH8 = BVH8();
+}
+
+bool Mesh::UpdateVertices(const std::vector<Vertex>& vertices) {
+	if (!IsEditable()) {
+		spdlog::error("Mesh {}: render only meshes can not update their vertices", m_Name);
+		return false;
+	}
+	if (vertices.size() != m_Vertices.size()) {
+		spdlog::error("Mesh {}: UpdateVertices expects {} vertices, got {}", m_Name, m_Vertices.size(), vertices.size());
+		return false;
+	}
+
+	Timer timer;
+	m_Vertices = vertices;
+	m_AABB = CreateAABB();
+
+	// m_Indices is in BVH order, so these corners line up with the leaf ranges.
+	std::vector<glm::vec3> corners = CalculateCorners(m_Indices);
+	float cost = m_BVH.Refit(corners);
+	bool rebuild = m_BVHSettings.RebuildThreshold > 0.0f && cost > m_BVH.GetBuildSAHCost() * m_BVHSettings.RebuildThreshold;
+	if (rebuild) {
+		std::vector<uint32_t> sourceIndices = CalculateSourceIndices();
+		corners = CalculateCorners(sourceIndices);
+		m_BVH.Build(corners, m_BVHSettings);
+		FillTriangles(sourceIndices, corners);
+		m_BVHStats = BVHStats::Calculate(m_BVH.GetNodes(), m_BVHSettings);
+	}
+	else {
+		for (uint32_t i = 0; i < m_Triangles.Size(); i++)
+			m_Triangles.Set(i, corners[i * 3], corners[i * 3 + 1], corners[i * 3 + 2]);
+	}
+	BuildWideBVHs();
+
+	spdlog::debug("BVH {} ({}): SAH cost {:.3f}, {:.2f} ms", rebuild ? "rebuild" : "refit", m_Name, cost, timer.ElapsedMillis());
+	return rebuild;
+}
+
+bool Mesh::Intersect(const Ray& ray, BVHLayout layout, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+	if (IsQuantized() && layout != BVHLayout::Binary) {
+		if (layout == BVHLayout::Wide8 && SIMD::SupportsAVX2())
+			return m_QuantizedBVH8.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+		return m_QuantizedBVH4.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+	}
+
+	switch (layout) {
+	case BVHLayout::Wide8:
+		if (SIMD::SupportsAVX2())
+			return m_BVH8.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+		return m_BVH4.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+	case BVHLayout::Wide4:
+		return m_BVH4.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+	default:
+		return m_BVH.Intersect(ray, m_Triangles, hitDistance, triangleIndex, barycentrics);
+	}
 }
 
-void Mesh::CalculateTriangles() {
-	for (uint32_t i = 0; i < m_Indices.size(); i += 3)
+bool Mesh::Occluded(const Ray& ray, BVHLayout layout, float tMax) const {
+	if (IsQuantized() && layout != BVHLayout::Binary) {
+		if (layout == BVHLayout::Wide8 && SIMD::SupportsAVX2())
+			return m_QuantizedBVH8.Occluded(ray, m_Triangles, tMax);
+		return m_QuantizedBVH4.Occluded(ray, m_Triangles, tMax);
+	}
+
+	switch (layout) {
+	case BVHLayout::Wide8:
+		if (SIMD::SupportsAVX2())
+			return m_BVH8.Occluded(ray, m_Triangles, tMax);
+		return m_BVH4.Occluded(ray, m_Triangles, tMax);
+	case BVHLayout::Wide4:
+		return m_BVH4.Occluded(ray, m_Triangles, tMax);
+	default:
+		return m_BVH.Occluded(ray, m_Triangles, tMax);
+	}
+}
+
+void Mesh::BenchmarkTriangleKernels(uint32_t rayCount) const {
+	// Every ray starts outside a leaf and points at its center, so only the leaf test is timed.
+	const BVHNodeArray& nodes = m_BVH.GetNodes();
+	std::vector<uint32_t> leaves;
+	for (uint32_t i = 0; i < nodes.size(); i++)
+	{
+		if (nodes[i].IsLeaf() && nodes[i].TriangleCount > 0)
+			leaves.push_back(i);
+	}
+	if (leaves.empty())
+		return;
+
+	std::vector<Ray> rays;
+	rays.reserve(rayCount);
+	Random random(0);
+	for (uint32_t r = 0; r < rayCount; r++)
+	{
+		const AABB& bounds = nodes[leaves[r % leaves.size()]].BoundingBox;
+		glm::vec3 center = bounds.GetCenter();
+		glm::vec3 direction = random.InUnitSphere();
+		float distance = glm::length(bounds.Max - bounds.Min) + 1.0f;
+		rays.emplace_back(center - direction * distance, direction);
+	}
+
+	const TriangleKernel kernels[] = { TriangleKernel::Scalar, TriangleKernel::SSE, TriangleKernel::AVX2 };
+	const char* names[] = { "scalar", "SSE", "AVX2" };
+	uint32_t kernelCount = SIMD::SupportsAVX2() ? 3 : 2;
+	float nanoseconds[3] = {};
+	uint64_t checksums[3] = {};
+	for (uint32_t k = 0; k < kernelCount; k++)
+	{
+		nanoseconds[k] = std::numeric_limits<float>::max();
+		for (uint32_t repeat = 0; repeat < 3; repeat++)
+		{
+			uint64_t checksum = 0;
+			Timer timer;
+			for (uint32_t r = 0; r < rayCount; r++)
+			{
+				const BVHNode& leaf = nodes[leaves[r % leaves.size()]];
+				float t = std::numeric_limits<float>::max();
+				uint32_t triangleIndex = 0;
+				glm::vec2 barycentrics;
+				if (m_Triangles.IntersectRange(kernels[k], leaf.LeftFirst, leaf.TriangleCount, rays[r], t, triangleIndex, barycentrics))
+					checksum += triangleIndex + 1;
+			}
+			nanoseconds[k] = std::min(nanoseconds[k], timer.Elapsed() * 1e9f / rayCount);
+			checksums[k] = checksum;
+		}
+	}
+
+	spdlog::info("Triangle kernels ({}): {} leaf tests over {} leaves, {:.1f} ns per leaf scalar", m_Name, rayCount, leaves.size(), nanoseconds[0]);
+	for (uint32_t k = 1; k < kernelCount; k++)
 	{
-		Triangle triangle;
-		triangle.A = m_Vertices[m_Indices[i]];
-		triangle.B = m_Vertices[m_Indices[i + 1]];
-		triangle.C = m_Vertices[m_Indices[i + 2]];
+		spdlog::info("Triangle kernels ({}): {:.1f} ns per leaf {}, {:.2f}x, same hits as scalar: {}", m_Name, nanoseconds[k], names[k],
+			nanoseconds[0] / nanoseconds[k], checksums[k] == checksums[0] ? "yes" : "no");
+	}
+}
+
+glm::vec2 Mesh::InterpolateTexCoord(uint32_t triangleIndex, const glm::vec2& barycentrics) const {
+	const glm::vec2& a = GetTriangleVertex(triangleIndex, 0).TexCoord;
+	const glm::vec2& b = GetTriangleVertex(triangleIndex, 1).TexCoord;
+	const glm::vec2& c = GetTriangleVertex(triangleIndex, 2).TexCoord;
+	return (1.0f - barycentrics.x - barycentrics.y) * a + barycentrics.x * b + barycentrics.y * c;
+}
+
+size_t Mesh::GetMemoryUsage() const {
+	return m_Vertices.capacity() * sizeof(Vertex) + m_Indices.capacity() * sizeof(uint32_t) + m_Triangles.GetMemoryUsage()
+		+ m_BVH.GetMemoryUsage() + m_BVH.GetTriangleOrder().capacity() * sizeof(uint32_t)
+		+ m_BVH4.GetMemoryUsage() + m_BVH8.GetMemoryUsage() + m_QuantizedBVH4.GetMemoryUsage() + m_QuantizedBVH8.GetMemoryUsage();
+}
+
+void Mesh::LogMemoryUsage() const {
+	size_t wideBytes = m_BVH4.GetMemoryUsage() + m_BVH8.GetMemoryUsage() + m_QuantizedBVH4.GetMemoryUsage() + m_QuantizedBVH8.GetMemoryUsage();
+	spdlog::info("Mesh memory ({}): {:.1f} KB = vertices {:.1f} KB, indices {:.1f} KB, intersection {:.1f} KB, BVH {:.1f} KB, BVH4 / BVH8 {:.1f} KB, triangle order {:.1f} KB ({})",
+		m_Name, GetMemoryUsage() / 1024.0f, m_Vertices.capacity() * sizeof(Vertex) / 1024.0f, m_Indices.capacity() * sizeof(uint32_t) / 1024.0f,
+		m_Triangles.GetMemoryUsage() / 1024.0f, m_BVH.GetMemoryUsage() / 1024.0f, wideBytes / 1024.0f,
+		m_BVH.GetTriangleOrder().capacity() * sizeof(uint32_t) / 1024.0f, IsEditable() ? "editable" : "render only");
+}
 
-		float centerX = (triangle.A.Position.x + triangle.B.Position.x + triangle.C.Position.x) / 3;
-		float centerY = (triangle.A.Position.y + triangle.B.Position.y + triangle.C.Position.y) / 3;
-		float centerZ = (triangle.A.Position.z + triangle.B.Position.z + triangle.C.Position.z) / 3;
-		glm::vec3 center = glm::vec3(centerX, centerY, centerZ);
-		triangle.Center = center;
+std::vector<glm::vec3> Mesh::CalculateCorners(const std::vector<uint32_t>& indices) const {
+	std::vector<glm::vec3> corners(indices.size());
+	for (uint32_t i = 0; i < indices.size(); i++)
+		corners[i] = m_Vertices[indices[i]].Position;
+	return corners;
+}
 
-		m_Triangles.push_back(triangle);
+std::vector<uint32_t> Mesh::CalculateSourceIndices() const {
+	// Undoes the BVH order, SBVH duplicates write the same triangle several times.
+	const std::vector<uint32_t>& order = m_BVH.GetTriangleOrder();
+	std::vector<uint32_t> indices((size_t)m_TriangleCount * 3);
+	for (uint32_t i = 0; i < order.size(); i++)
+	{
+		if (order[i] == BVH::PaddingTriangle)
+			continue;
+		for (uint32_t k = 0; k < 3; k++)
+			indices[order[i] * 3 + k] = m_Indices[i * 3 + k];
+	}
+	return indices;
+}
+
+void Mesh::FillTriangles(const std::vector<uint32_t>& sourceIndices, const std::vector<glm::vec3>& corners) {
+	// Spatial splits can list a triangle in several leaves, those triangles are copied.
+	// Padding slots between leaves point all corners at the first vertex, a degenerate
+	// triangle that is never hit, also after UpdateVertices refills the buffer.
+	const std::vector<uint32_t>& order = m_BVH.GetTriangleOrder();
+	m_TriangleCount = (uint32_t)(sourceIndices.size() / 3);
+	m_Triangles.Resize(order.size());
+	std::vector<uint32_t> indices(order.size() * 3, 0);
+	for (uint32_t i = 0; i < order.size(); i++)
+	{
+		uint32_t triangle = order[i];
+		if (triangle == BVH::PaddingTriangle)
+			continue;
+		m_Triangles.Set(i, corners[triangle * 3], corners[triangle * 3 + 1], corners[triangle * 3 + 2]);
+		for (uint32_t k = 0; k < 3; k++)
+			indices[i * 3 + k] = sourceIndices[triangle * 3 + k];
 	}
+	m_Indices = std::move(indices);
 }
 
 AABB Mesh::CreateAABB() {
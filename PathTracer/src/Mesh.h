@@ -4,39 +4,102 @@
 //#include "AABB.h"
 #include "Material.h"
 
-#include "BVHNode.h"
+#include "BVH.h"
+#include "WideBVH.h"
+#include "QuantizedBVH.h"
+#include "BVHStats.h"
 
 #include <glm/glm.hpp>
 
 #include <vector>
 #include <string>
 
+enum class MeshStorage {
+	Editable,  // Keeps what RebuildBVH and UpdateVertices need
+	RenderOnly // Frees it once the BVHs are built
+};
+
 class Mesh {
 public:
-	Mesh(const std::string& name, const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, const Material& material);
+	Mesh(const std::string& name, std::vector<Vertex> vertices, const std::vector<uint32_t>& indices, const Material& material,
+		const BVHBuildSettings& bvhSettings = BVHBuildSettings(), MeshStorage storage = MeshStorage::Editable);
 
 	const std::vector<Vertex>& GetVertices() const { return m_Vertices; }
+	// Three vertex indices per triangle of GetTriangles(), so in BVH order rather than the
+	// order the mesh was created with. The padding slots between BVH leaves repeat vertex 0.
 	const std::vector<uint32_t>& GetIndices() const { return m_Indices; }
-	const std::vector<Triangle>& GetTriangles() const { return m_Triangles; }
+	// Intersection data of the triangles, in BVH order.
+	const TriangleBuffer& GetTriangles() const { return m_Triangles; }
+	const Vertex& GetTriangleVertex(uint32_t triangleIndex, uint32_t corner) const { return m_Vertices[m_Indices[triangleIndex * 3 + corner]]; }
+	// Barycentrics as returned by TriangleBuffer::Intersect, the weights of the second and third corner.
+	glm::vec2 InterpolateTexCoord(uint32_t triangleIndex, const glm::vec2& barycentrics) const;
 
 	const std::string& GetName() const { return m_Name; }
 	const AABB& GetAABB() const { return m_AABB; }
-	BVHNode* GetBVH() const { return m_BVHNode; }
+	const BVH& GetBVH() const { return m_BVH; }
+	const BVH4& GetBVH4() const { return m_BVH4; }
+	const BVH8& GetBVH8() const { return m_BVH8; }
+	const QuantizedBVH4& GetQuantizedBVH4() const { return m_QuantizedBVH4; }
+	const QuantizedBVH8& GetQuantizedBVH8() const { return m_QuantizedBVH8; }
+	// Large meshes replace the float BVH4 / BVH8 by quantized ones, see BVHBuildSettings.
+	bool IsQuantized() const { return !m_QuantizedBVH4.IsEmpty(); }
+	const BVHBuildSettings& GetBVHSettings() const { return m_BVHSettings; }
+	const BVHStats& GetBVHStats() const { return m_BVHStats; }
+	bool IsEditable() const { return m_Storage == MeshStorage::Editable; }
+	// Bytes of geometry and acceleration structures kept by the mesh.
+	size_t GetMemoryUsage() const;
+
+	// Builds the BVH again from scratch, e.g. after tuning the settings in the UI.
+	// Instances using the mesh need Scene::BuildTLAS afterwards. Editable meshes only.
+	void RebuildBVH(const BVHBuildSettings& settings);
+
+	// Moves the vertices and refits the BVH, or rebuilds it when the refit degraded it past
+	// BVHBuildSettings::RebuildThreshold. The vertex count has to stay the same. Returns true
+	// on a full rebuild. Instances using the mesh need Scene::BuildTLAS afterwards. Editable meshes only.
+	bool UpdateVertices(const std::vector<Vertex>& vertices);
+
+	// Closest hit against the triangles using the given BVH layout. The ray is in object space.
+	// hitDistance, triangleIndex and barycentrics are only written when a closer hit is found.
+	bool Intersect(const Ray& ray, BVHLayout layout, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const;
+	// Visibility only: true if any triangle is hit closer than tMax.
+	bool Occluded(const Ray& ray, BVHLayout layout, float tMax) const;
+	// Closest hits of a ray packet, always through the binary BVH. Returns the lanes that found a closer hit.
+	template<uint32_t Width>
+	uint32_t IntersectPacket(const RayPacket<Width>& packet, float* hitDistance, uint32_t* triangleIndex, glm::vec2* barycentrics) const {
+		return m_BVH.IntersectPacket(packet, m_Triangles, hitDistance, triangleIndex, barycentrics);
+	}
+
+	// Times the leaf intersection kernels against each other on rays aimed at the leaves of the
+	// binary BVH and logs the results.
+	void BenchmarkTriangleKernels(uint32_t rayCount = 1 << 18) const;
 
 	const Material& GetMaterial() const { return m_Material; }
 	Material& GetMaterial() { return m_Material; }
 private:
-	void CalculateTriangles();
+	std::vector<glm::vec3> CalculateCorners(const std::vector<uint32_t>& indices) const;
+	std::vector<uint32_t> CalculateSourceIndices() const;
+	void FillTriangles(const std::vector<uint32_t>& sourceIndices, const std::vector<glm::vec3>& corners);
+	void BuildBVH(const std::vector<uint32_t>& sourceIndices);
+	void BuildWideBVHs();
+	void LogMemoryUsage() const;
 	AABB CreateAABB();
 private:
 	std::string m_Name;
 
 	std::vector<Vertex> m_Vertices;
 	std::vector<uint32_t> m_Indices;
-	std::vector<Triangle> m_Triangles;
+	uint32_t m_TriangleCount = 0; // Without the SBVH duplicates
+	TriangleBuffer m_Triangles;
+	MeshStorage m_Storage = MeshStorage::Editable;
 
 	AABB m_AABB;
-	BVHNode* m_BVHNode = nullptr;
+	BVH m_BVH;
+	BVH4 m_BVH4;
+	BVH8 m_BVH8;
+	QuantizedBVH4 m_QuantizedBVH4;
+	QuantizedBVH8 m_QuantizedBVH8;
+	BVHBuildSettings m_BVHSettings;
+	BVHStats m_BVHStats;
 
 	Material m_Material;
 };
\ No newline at end of file
@@ -1,23 +1,41 @@
 #include "Model.h"
+#include "Memory.h"
 
 #include <spdlog/spdlog.h>
 
-Model::Model(const std::string& path) {
-	Assimp::Importer importer;
+#include <algorithm>
 
-	const aiScene* scene = importer.ReadFile(path,
-		aiProcess_CalcTangentSpace |
-		aiProcess_Triangulate |
-		aiProcess_FlipUVs);
+Model::Model(const std::string& path, const BVHBuildSettings& bvhSettings, MeshStorage storage)
+	: m_BVHSettings(bvhSettings), m_Storage(storage) {
+	size_t memoryBefore = Memory::GetCurrentUsage();
+	{
+		Assimp::Importer importer;
 
-	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
-		spdlog::error("Error: {}", importer.GetErrorString());
-	}
-	else {
-		// Start processing the model data beginning with the root node
-		ProcessNode(scene->mRootNode, scene);
+		// Joining identical vertices lets the triangles share them through the index buffer.
+		const aiScene* scene = importer.ReadFile(path,
+			aiProcess_CalcTangentSpace |
+			aiProcess_Triangulate |
+			aiProcess_JoinIdenticalVertices |
+			aiProcess_FlipUVs);
+
+		if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode) {
+			spdlog::error("Error: {}", importer.GetErrorString());
+		}
+		else {
+			// Start processing the model data beginning with the root node
+			ProcessNode(scene->mRootNode, scene);
+		}
 	}
 	m_AABB = CreateAABB();
+
+	// The peak only covers this load if nothing before it used more memory.
+	size_t meshBytes = 0;
+	for (const Mesh& mesh : m_Meshes)
+		meshBytes += mesh.GetMemoryUsage();
+	size_t memoryAfter = Memory::GetCurrentUsage();
+	size_t memoryPeak = Memory::GetPeakUsage();
+	spdlog::info("Model memory ({}): {:.2f} MB in meshes, process +{:.2f} MB after load, +{:.2f} MB at peak", path, meshBytes / (1024.0f * 1024.0f),
+		(memoryAfter - std::min(memoryBefore, memoryAfter)) / (1024.0f * 1024.0f), (memoryPeak - std::min(memoryBefore, memoryPeak)) / (1024.0f * 1024.0f));
 }
 
 bool Model::IntersectsWithRay(const glm::vec3& origin, const glm::vec3& direction) const {
@@ -86,8 +104,7 @@ void Model::ProcessNode(const aiNode* node, const aiScene* scene)
 			// Access material properties
 			Material newMaterial = ProcessNodeMaterials(material);
 
-			Mesh newMesh(name, vertices, indices, newMaterial);
-			m_Meshes.push_back(newMesh);
+			m_Meshes.emplace_back(name, std::move(vertices), indices, newMaterial, m_BVHSettings, m_Storage);
 		}
 
 	}
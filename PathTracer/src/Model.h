@@ -11,7 +11,7 @@
 
 class Model {
 public:
-	Model(const std::string& path);
+	Model(const std::string& path, const BVHBuildSettings& bvhSettings = BVHBuildSettings(), MeshStorage storage = MeshStorage::Editable);
 
 	bool IntersectsWithRay(const glm::vec3& origin, const glm::vec3& direction) const;
 
@@ -26,6 +26,8 @@ private:
 	AABB CreateAABB();
 private:
 	std::vector<Mesh> m_Meshes;
+	BVHBuildSettings m_BVHSettings;
+	MeshStorage m_Storage;
 
 	AABB m_AABB;
 };
\ No newline at end of file
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+
+// Spreads the lower 10 bits of v so there are two zero bits between each of them.
+inline uint32_t ExpandBits3D(uint32_t v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Spreads the lower 16 bits of v so there is a zero bit between each of them.
+inline uint32_t ExpandBits2D(uint32_t v) {
+	v &= 0x0000FFFFu;
+	v = (v | (v << 8)) & 0x00FF00FFu;
+	v = (v | (v << 4)) & 0x0F0F0F0Fu;
+	v = (v | (v << 2)) & 0x33333333u;
+	v = (v | (v << 1)) & 0x55555555u;
+	return v;
+}
+
+// 30 bit Morton code of a cell of a 1024^3 grid, x in the highest bit of each triple.
+inline uint32_t MortonCode(const glm::uvec3& cell) {
+	return (ExpandBits3D(cell.x) << 2) | (ExpandBits3D(cell.y) << 1) | ExpandBits3D(cell.z);
+}
+
+// 32 bit Morton code of a cell of a 65536^2 grid, x in the lowest bit of each pair.
+// Sorting by it walks a Z curve.
+inline uint32_t MortonCode(const glm::uvec2& cell) {
+	return ExpandBits2D(cell.x) | (ExpandBits2D(cell.y) << 1);
+}
+
+// Least significant digit radix sort of 30 bit keys, three passes of 10 bits. values holds one
+// entry per key and is reordered along with them. Equal keys keep their order. The scratch
+// arrays are resized as needed, keeping them between calls saves the allocations.
+inline void RadixSortByKey(std::vector<uint32_t>& keys, std::vector<uint32_t>& values,
+	std::vector<uint32_t>& keyScratch, std::vector<uint32_t>& valueScratch) {
+	const size_t count = keys.size();
+	keyScratch.resize(count);
+	valueScratch.resize(count);
+
+	uint32_t offsets[1024];
+	for (uint32_t shift = 0; shift < 30; shift += 10)
+	{
+		std::fill(std::begin(offsets), std::end(offsets), 0);
+		for (size_t i = 0; i < count; i++)
+			offsets[(keys[i] >> shift) & 1023]++;
+
+		uint32_t sum = 0;
+		for (uint32_t& offset : offsets)
+		{
+			uint32_t digitCount = offset;
+			offset = sum;
+			sum += digitCount;
+		}
+
+		for (size_t i = 0; i < count; i++)
+		{
+			uint32_t destination = offsets[(keys[i] >> shift) & 1023]++;
+			keyScratch[destination] = keys[i];
+			valueScratch[destination] = values[i];
+		}
+		std::swap(keys, keyScratch);
+		std::swap(values, valueScratch);
+	}
+}
@@ -0,0 +1,170 @@
+#include "QuantizedBVH.h"
+#include "SIMD.h"
+#include "BVHTraversal.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+// Turns 4 grid coordinates into floats with SSE2 only.
+static inline __m128 Dequantize4(const uint8_t* values, float origin, float scale) {
+	int32_t packed;
+	std::memcpy(&packed, values, sizeof(packed));
+	__m128i bytes = _mm_cvtsi32_si128(packed);
+	__m128i words = _mm_unpacklo_epi8(bytes, _mm_setzero_si128());
+	__m128i integers = _mm_unpacklo_epi16(words, _mm_setzero_si128());
+	return _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(integers), _mm_set1_ps(scale)), _mm_set1_ps(origin));
+}
+
+static inline uint32_t IntersectChildren(const QuantizedWideBVHNode<4>& node, const Ray& ray, float tMax, float* distances) {
+	const __m128 originX = _mm_set1_ps(ray.Origin.x);
+	const __m128 originY = _mm_set1_ps(ray.Origin.y);
+	const __m128 originZ = _mm_set1_ps(ray.Origin.z);
+	const __m128 invDirectionX = _mm_set1_ps(ray.InvDirection.x);
+	const __m128 invDirectionY = _mm_set1_ps(ray.InvDirection.y);
+	const __m128 invDirectionZ = _mm_set1_ps(ray.InvDirection.z);
+
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MinX, node.Origin[0], node.Scale[0]), originX), invDirectionX);
+	__m128 t2x = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MaxX, node.Origin[0], node.Scale[0]), originX), invDirectionX);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MinY, node.Origin[1], node.Scale[1]), originY), invDirectionY);
+	__m128 t2y = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MaxY, node.Origin[1], node.Scale[1]), originY), invDirectionY);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MinZ, node.Origin[2], node.Scale[2]), originZ), invDirectionZ);
+	__m128 t2z = _mm_mul_ps(_mm_sub_ps(Dequantize4(node.MaxZ, node.Origin[2], node.Scale[2]), originZ), invDirectionZ);
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps()));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(tNear, _mm_set1_ps(tMax)));
+
+	// Empty slots decode to a valid box, so mask them out by count.
+	_mm_storeu_ps(distances, tNear);
+	return (uint32_t)_mm_movemask_ps(hit) & ((1u << node.ChildCount) - 1);
+}
+
+PT_TARGET_AVX2 static inline __m256 Dequantize8(const uint8_t* values, float origin, float scale) {
+	__m256i integers = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)values));
+	return _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(integers), _mm256_set1_ps(scale)), _mm256_set1_ps(origin));
+}
+
+PT_TARGET_AVX2 static uint32_t IntersectChildren(const QuantizedWideBVHNode<8>& node, const Ray& ray, float tMax, float* distances) {
+	const __m256 originX = _mm256_set1_ps(ray.Origin.x);
+	const __m256 originY = _mm256_set1_ps(ray.Origin.y);
+	const __m256 originZ = _mm256_set1_ps(ray.Origin.z);
+	const __m256 invDirectionX = _mm256_set1_ps(ray.InvDirection.x);
+	const __m256 invDirectionY = _mm256_set1_ps(ray.InvDirection.y);
+	const __m256 invDirectionZ = _mm256_set1_ps(ray.InvDirection.z);
+
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MinX, node.Origin[0], node.Scale[0]), originX), invDirectionX);
+	__m256 t2x = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MaxX, node.Origin[0], node.Scale[0]), originX), invDirectionX);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MinY, node.Origin[1], node.Scale[1]), originY), invDirectionY);
+	__m256 t2y = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MaxY, node.Origin[1], node.Scale[1]), originY), invDirectionY);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MinZ, node.Origin[2], node.Scale[2]), originZ), invDirectionZ);
+	__m256 t2z = _mm256_mul_ps(_mm256_sub_ps(Dequantize8(node.MaxZ, node.Origin[2], node.Scale[2]), originZ), invDirectionZ);
+
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x), _mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x), _mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tNear, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+	_mm256_storeu_ps(distances, tNear);
+	return (uint32_t)_mm256_movemask_ps(hit) & ((1u << node.ChildCount) - 1);
+}
+
+// Grid coordinates of [min, max] on a grid starting at origin, rounded outwards. The decoded
+// values are checked with a small slack since the SIMD decode may be fused into an FMA.
+static void Quantize(float min, float max, float origin, float scale, uint8_t& outMin, uint8_t& outMax) {
+	if (scale <= 0.0f) {
+		outMin = 0;
+		outMax = 0;
+		return;
+	}
+
+	const float slack = (std::abs(origin) + 255.0f * scale) * 1e-6f;
+	int low = std::clamp((int)std::floor((min - origin) / scale), 0, 255);
+	int high = std::clamp((int)std::ceil((max - origin) / scale), 0, 255);
+	while (low > 0 && low * scale + origin > min - slack)
+		low--;
+	while (high < 255 && high * scale + origin < max + slack)
+		high++;
+	outMin = (uint8_t)low;
+	outMax = (uint8_t)high;
+}
+
+template<uint32_t Width>
+void QuantizedWideBVH<Width>::Build(const WideBVH<Width>& wideBVH) {
+	const std::vector<WideBVHNode<Width>>& wideNodes = wideBVH.GetNodes();
+	m_Nodes.assign(wideNodes.size(), QuantizedWideBVHNode<Width>());
+
+	for (size_t n = 0; n < wideNodes.size(); n++)
+	{
+		const WideBVHNode<Width>& wide = wideNodes[n];
+		QuantizedWideBVHNode<Width>& node = m_Nodes[n];
+
+		// Unused slots have NaN bounds and always come last.
+		uint32_t childCount = 0;
+		while (childCount < Width && !std::isnan(wide.MinX[childCount]))
+			childCount++;
+
+		const float* mins[3] = { wide.MinX, wide.MinY, wide.MinZ };
+		const float* maxs[3] = { wide.MaxX, wide.MaxY, wide.MaxZ };
+		uint8_t* quantizedMins[3] = { node.MinX, node.MinY, node.MinZ };
+		uint8_t* quantizedMaxs[3] = { node.MaxX, node.MaxY, node.MaxZ };
+		for (int axis = 0; axis < 3; axis++)
+		{
+			float low = std::numeric_limits<float>::max();
+			float high = -std::numeric_limits<float>::max();
+			for (uint32_t i = 0; i < childCount; i++)
+			{
+				low = std::min(low, mins[axis][i]);
+				high = std::max(high, maxs[axis][i]);
+			}
+
+			// A slightly larger step keeps the top of the grid above the largest child.
+			node.Origin[axis] = low;
+			node.Scale[axis] = high > low ? (high - low) / 255.0f * 1.0001f : 0.0f;
+			for (uint32_t i = 0; i < childCount; i++)
+				Quantize(mins[axis][i], maxs[axis][i], low, node.Scale[axis], quantizedMins[axis][i], quantizedMaxs[axis][i]);
+		}
+
+		for (uint32_t i = 0; i < childCount; i++)
+		{
+			node.Child[i] = wide.Child[i];
+			node.Count[i] = (uint16_t)wide.Count[i];
+		}
+		node.ChildCount = childCount;
+	}
+}
+
+template<uint32_t Width>
+bool QuantizedWideBVH<Width>::Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+	bool hit = false;
+	TraverseWideBVH<Width>(m_Nodes, hitDistance,
+		[&](const QuantizedWideBVHNode<Width>& node, float tMax, float* distances) {
+			return IntersectChildren(node, ray, tMax, distances);
+		},
+		[&](uint32_t first, uint32_t count) {
+			hit |= triangles.IntersectRange(first, count, ray, hitDistance, triangleIndex, barycentrics);
+			return false;
+		});
+	return hit;
+}
+
+template<uint32_t Width>
+bool QuantizedWideBVH<Width>::Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const {
+	bool occluded = false;
+	TraverseWideBVH<Width>(m_Nodes, tMax,
+		[&](const QuantizedWideBVHNode<Width>& node, float maxDistance, float* distances) {
+			return IntersectChildren(node, ray, maxDistance, distances);
+		},
+		[&](uint32_t first, uint32_t count) {
+			occluded = triangles.OccludedRange(first, count, ray, tMax);
+			return occluded;
+		});
+	return occluded;
+}
+
+template class QuantizedWideBVH<4>;
+template class QuantizedWideBVH<8>;
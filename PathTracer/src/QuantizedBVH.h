@@ -0,0 +1,47 @@
+#pragma once
+
+#include "WideBVH.h"
+
+#include <vector>
+
+// Wide node with 8 bit child bounds. Each child box is stored on a 255 step grid spanning
+// the union of the children, rounded outwards so it never shrinks. Children fill the first
+// ChildCount slots.
+template<uint32_t Width>
+struct alignas(16) QuantizedWideBVHNode {
+	float Origin[3]; // Smallest corner of the grid
+	float Scale[3];  // Size of one grid step
+	uint8_t MinX[Width];
+	uint8_t MinY[Width];
+	uint8_t MinZ[Width];
+	uint8_t MaxX[Width];
+	uint8_t MaxY[Width];
+	uint8_t MaxZ[Width];
+	uint32_t Child[Width]; // Node index, or the first triangle of a leaf child
+	uint16_t Count[Width]; // Triangles in a leaf child, 0 for internal children
+	uint32_t ChildCount;
+};
+
+// Quantized copy of a WideBVH with the same node indices and leaf ranges. Halves the node
+// memory for large meshes at the cost of a few decode instructions per node and slightly
+// looser boxes.
+template<uint32_t Width>
+class QuantizedWideBVH {
+public:
+	QuantizedWideBVH() = default;
+
+	void Build(const WideBVH<Width>& wideBVH);
+
+	bool Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const;
+	// True if any triangle is hit closer than tMax.
+	bool Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const;
+
+	const std::vector<QuantizedWideBVHNode<Width>>& GetNodes() const { return m_Nodes; }
+	bool IsEmpty() const { return m_Nodes.empty(); }
+	size_t GetMemoryUsage() const { return m_Nodes.capacity() * sizeof(QuantizedWideBVHNode<Width>); }
+private:
+	std::vector<QuantizedWideBVHNode<Width>> m_Nodes;
+};
+
+using QuantizedBVH4 = QuantizedWideBVH<4>;
+using QuantizedBVH8 = QuantizedWideBVH<8>;
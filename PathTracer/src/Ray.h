@@ -5,4 +5,9 @@
 struct Ray {
 	glm::vec3 Origin;
 	glm::vec3 Direction;
+	glm::vec3 InvDirection; // Precomputed for the slab tests
+
+	Ray() = default;
+	Ray(const glm::vec3& origin, const glm::vec3& direction)
+		: Origin(origin), Direction(direction), InvDirection(1.0f / direction) {}
 };
\ No newline at end of file
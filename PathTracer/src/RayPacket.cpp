@@ -0,0 +1,42 @@
+#include "RayPacket.h"
+#include "SIMD.h"
+
+uint32_t IntersectBox(const AABB& box, const RayPacket<4>& packet, const float* tMax, uint32_t mask) {
+	const __m128 originX = _mm_load_ps(packet.OriginX);
+	const __m128 originY = _mm_load_ps(packet.OriginY);
+	const __m128 originZ = _mm_load_ps(packet.OriginZ);
+
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Min.x), originX), _mm_load_ps(packet.InvDirectionX));
+	__m128 t2x = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Max.x), originX), _mm_load_ps(packet.InvDirectionX));
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Min.y), originY), _mm_load_ps(packet.InvDirectionY));
+	__m128 t2y = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Max.y), originY), _mm_load_ps(packet.InvDirectionY));
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Min.z), originZ), _mm_load_ps(packet.InvDirectionZ));
+	__m128 t2z = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(box.Max.z), originZ), _mm_load_ps(packet.InvDirectionZ));
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps()));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(tNear, _mm_loadu_ps(tMax)));
+	return (uint32_t)_mm_movemask_ps(hit) & mask;
+}
+
+PT_TARGET_AVX2 uint32_t IntersectBox(const AABB& box, const RayPacket<8>& packet, const float* tMax, uint32_t mask) {
+	const __m256 originX = _mm256_load_ps(packet.OriginX);
+	const __m256 originY = _mm256_load_ps(packet.OriginY);
+	const __m256 originZ = _mm256_load_ps(packet.OriginZ);
+
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Min.x), originX), _mm256_load_ps(packet.InvDirectionX));
+	__m256 t2x = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Max.x), originX), _mm256_load_ps(packet.InvDirectionX));
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Min.y), originY), _mm256_load_ps(packet.InvDirectionY));
+	__m256 t2y = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Max.y), originY), _mm256_load_ps(packet.InvDirectionY));
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Min.z), originZ), _mm256_load_ps(packet.InvDirectionZ));
+	__m256 t2z = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(box.Max.z), originZ), _mm256_load_ps(packet.InvDirectionZ));
+
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x), _mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x), _mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tNear, _mm256_loadu_ps(tMax), _CMP_LT_OQ));
+	return (uint32_t)_mm256_movemask_ps(hit) & mask;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "AABB.h"
+#include "Ray.h"
+
+#include <cstdint>
+
+// Up to Width coherent rays traced together, e.g. the primary rays of a screen tile. The rays
+// are kept as Ray for the triangle tests and the single ray fallback, and per component for
+// the SIMD box test. Lanes not set in ActiveMask are ignored.
+template<uint32_t Width>
+struct RayPacket {
+	Ray Rays[Width];
+	alignas(32) float OriginX[Width];
+	alignas(32) float OriginY[Width];
+	alignas(32) float OriginZ[Width];
+	alignas(32) float InvDirectionX[Width];
+	alignas(32) float InvDirectionY[Width];
+	alignas(32) float InvDirectionZ[Width];
+	uint32_t ActiveMask = 0;
+
+	RayPacket() {
+		// Inactive lanes still go through the box test, keep them finite.
+		for (uint32_t i = 0; i < Width; i++)
+		{
+			OriginX[i] = OriginY[i] = OriginZ[i] = 0.0f;
+			InvDirectionX[i] = InvDirectionY[i] = InvDirectionZ[i] = 1.0f;
+		}
+	}
+
+	void Set(uint32_t lane, const Ray& ray) {
+		Rays[lane] = ray;
+		OriginX[lane] = ray.Origin.x;
+		OriginY[lane] = ray.Origin.y;
+		OriginZ[lane] = ray.Origin.z;
+		InvDirectionX[lane] = ray.InvDirection.x;
+		InvDirectionY[lane] = ray.InvDirection.y;
+		InvDirectionZ[lane] = ray.InvDirection.z;
+		ActiveMask |= 1u << lane;
+	}
+
+	// Packet traversal visits nodes in the front to back order of one ray, which only suits
+	// the others when every direction has the same signs.
+	bool IsCoherent() const {
+		int first = -1;
+		for (uint32_t i = 0; i < Width; i++)
+		{
+			if (!(ActiveMask & (1u << i)))
+				continue;
+			if (first < 0) {
+				first = i;
+				continue;
+			}
+			glm::bvec3 sameSign = glm::equal(glm::lessThan(Rays[i].Direction, glm::vec3(0.0f)), glm::lessThan(Rays[first].Direction, glm::vec3(0.0f)));
+			if (!glm::all(sameSign))
+				return false;
+		}
+		return true;
+	}
+};
+
+// Slab test of one box against the rays of mask. Returns the lanes that hit it in front of
+// their tMax. The 8 wide version needs AVX2, see SIMD::SupportsAVX2.
+uint32_t IntersectBox(const AABB& box, const RayPacket<4>& packet, const float* tMax, uint32_t mask);
+uint32_t IntersectBox(const AABB& box, const RayPacket<8>& packet, const float* tMax, uint32_t mask);
@@ -1,28 +1,24 @@
 #include "Renderer.h"
 #include "Mesh.h"
+#include "Morton.h"
+#include "SIMD.h"
 
 #include "Utils.h"
 
 #include <algorithm>
-#include <execution>
+#include <bit>
 
 #include <glm/gtx/compatibility.hpp>
 #include <glm/gtx/color_space.hpp>
+#include <spdlog/spdlog.h>
 
-void Renderer::OnResize(uint32_t width, uint32_t height) {
-	if (m_Width == width && m_Height == height && !m_First)
-		return;
+static float Luminance(const glm::vec3& color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
 
+void Renderer::OnResize(uint32_t width, uint32_t height) {
 	m_Width = width;
 	m_Height = height;
-
-	m_ImageHorizontalIter.resize(width);
-	m_ImageVerticalIter.resize(height);
-	for (uint32_t i = 0; i < width; i++)
-		m_ImageHorizontalIter[i] = i;
-	for (uint32_t i = 0; i < height; i++)
-		m_ImageVerticalIter[i] = i;
-	m_First = false;
 }
 
 void Renderer::Render(const Scene& scene, const Camera& camera, Image& image, Image& accumulationImage) {
@@ -34,223 +30,703 @@ void Renderer::Render(const Scene& scene, const Camera& camera, Image& image, Im
 
 	m_Width = image.GetWidth();
 	m_Height = image.GetHeight();
+	if (m_PixelStats.size() != (size_t)m_Width * m_Height) {
+		m_PixelStats.resize((size_t)m_Width * m_Height);
+		m_BlockCountX = (m_Width + AdaptiveBlockSize - 1) / AdaptiveBlockSize;
+		size_t blockCount = m_BlockCountX * ((m_Height + AdaptiveBlockSize - 1) / AdaptiveBlockSize);
+		m_BlockConverged.resize(blockCount);
+		m_BlockError.resize(blockCount);
+		m_FrameIndex = 1;
+	}
 
 	if (m_FrameIndex == 1) {
-		m_AccumulationImage->Clear();
+		m_Finished = false;
+		m_Stats.RenderTime = 0.0f;
+		// The old accumulation's noise must not end the new one after its first pass.
+		m_Stats.Noise = std::numeric_limits<float>::infinity();
+		m_Stats.ConvergedPixelShare = 0.0f;
+	}
+	// Once finished the image is left as it is and the CPU is free, until the view or the targets change.
+	if (IsTargetReached()) {
+		m_Stats.FrameTime = 0.0f;
+		m_Stats.EstimatedTimeLeft = 0.0f;
+		return;
 	}
+	m_Finished = false;
+
+	Timer timer;
+	m_RayCount = 0;
+	m_PacketFallbackCount = 0;
+	m_SampledPixelCount = 0;
+	m_Scheduler.ResetStats();
+	m_Stats.Depths.clear();
+	for (std::atomic<uint64_t>& count : m_MaterialSwitchCount)
+		count = 0;
 
 #define MT 1 //Multithreading
+	// Primary rays first, so they can be traced in packets and timed on their own.
+	TracePrimaryRays();
+	m_Stats.PrimaryTime = timer.ElapsedMillis();
+
+	// Keep taking samples while the next one, estimated from the average so far, fits in the budget.
+	// Without accumulation the samples of this frame are still averaged.
+	uint32_t sampleCount = 0;
+	float sampleTime;
+	do {
+		if (m_FrameIndex == 1) {
+			m_AccumulationImage->Clear();
+			std::fill(m_PixelStats.begin(), m_PixelStats.end(), PixelStats());
+			std::fill(m_BlockConverged.begin(), m_BlockConverged.end(), 0);
+		}
+		if (m_Settings.Integrator == RenderIntegrator::Wavefront)
+			RenderWavefront();
+		else
 #if MT
-	std::for_each(std::execution::par, m_ImageVerticalIter.begin(), m_ImageVerticalIter.end(),
-		[this](uint32_t y)
-		{
-			std::for_each(std::execution::par, m_ImageHorizontalIter.begin(), m_ImageHorizontalIter.end(),
-			[this, y](uint32_t x) {
-					uint32_t i = y * m_Width + x;
-					glm::vec3 color = PerPixel(i);
-					glm::vec3 prevAccumulatedColor = m_AccumulationImage->GetPixel(i);
-					glm::vec3 newAccumulatedColor = prevAccumulatedColor + color;
-					m_AccumulationImage->SetPixel(i, newAccumulatedColor);
-					newAccumulatedColor /= (float)m_FrameIndex;
-
-					m_Image->SetPixel(i, newAccumulatedColor);
-			});
-		});
+			m_Scheduler.Run(m_Width, m_Height, [this](const Tile& tile) { RenderTile(tile); });
 #else
-	for (uint32_t y = 0; y < m_Height; y++)
+			RenderTile({ 0, 0, m_Width, m_Height });
+#endif
+		sampleCount++;
+		m_FrameIndex++;
+		// The adaptive sampler needs fresh block errors for every pass, otherwise once per frame is enough.
+		if (m_Settings.AdaptiveSampling)
+			UpdateNoise();
+		sampleTime = (timer.ElapsedMillis() - m_Stats.PrimaryTime) / sampleCount;
+	} while (timer.ElapsedMillis() + sampleTime <= m_Settings.FrameBudget && !IsTargetReached());
+	if (!m_Settings.AdaptiveSampling)
+		UpdateNoise();
+
+	uint64_t primaryRayCount = (uint64_t)m_Width * m_Height;
+	m_Stats.FrameTime = timer.ElapsedMillis();
+	m_Stats.SampleCount = sampleCount;
+	m_Stats.MSamplesPerSecond = m_SampledPixelCount / (m_Stats.FrameTime * 1000.0f);
+	// Every sample counts its primary ray, but they were traced only once.
+	m_Stats.RayCount = m_RayCount - m_SampledPixelCount + primaryRayCount;
+	m_Stats.MRaysPerSecond = m_Stats.RayCount / (m_Stats.FrameTime * 1000.0f);
+	m_Stats.AveragePathLength = (float)m_RayCount / std::max<uint64_t>(m_SampledPixelCount, 1);
+	m_Stats.PrimaryMRaysPerSecond = primaryRayCount / (m_Stats.PrimaryTime * 1000.0f);
+	m_Stats.SecondaryMRaysPerSecond = (m_Stats.RayCount - primaryRayCount) / ((m_Stats.FrameTime - m_Stats.PrimaryTime) * 1000.0f);
+	m_Stats.PacketFallbackCount = m_PacketFallbackCount;
+
+	const std::vector<TileScheduler::ThreadStats>& threadStats = m_Scheduler.GetThreadStats();
+	m_Stats.TileCount = 0;
+	m_Stats.StolenTileCount = 0;
+	m_Stats.SplitTileCount = m_Scheduler.GetSplitCount();
+	m_Stats.ThreadUtilization.resize(threadStats.size());
+	for (size_t i = 0; i < threadStats.size(); i++)
 	{
-		for (uint32_t x = 0; x < m_Width; x++)
-		{
-			uint32_t i = y * m_Width + x;
-			glm::vec3 color = PerPixel(i);
-			glm::vec3 prevAccumulatedColor = m_AccumulationImage->GetPixel(i);
-			glm::vec3 newAccumulatedColor = prevAccumulatedColor + color;
-			m_AccumulationImage->SetPixel(i, newAccumulatedColor);
-			newAccumulatedColor /= (float)m_FrameIndex;
+		m_Stats.TileCount += threadStats[i].TileCount;
+		m_Stats.StolenTileCount += threadStats[i].StolenCount;
+		m_Stats.ThreadUtilization[i] = threadStats[i].BusyTime / m_Stats.FrameTime;
+	}
 
-			m_Image->SetPixel(i, newAccumulatedColor);
-		}
+	for (size_t depth = 0; depth < m_Stats.Depths.size(); depth++)
+		m_Stats.Depths[depth].MaterialSwitchRate = (float)m_MaterialSwitchCount[depth] / std::max<uint64_t>(m_Stats.Depths[depth].RayCount, 1);
+
+	// Monte Carlo error falls with the square root of the samples, so of the render time as well.
+	m_Stats.RenderTime += m_Stats.FrameTime / 1000.0f;
+	m_Stats.AccumulatedSampleCount = m_FrameIndex - 1;
+	m_Stats.EstimatedTimeLeft = -1.0f;
+	if (m_Settings.TargetNoise > 0.0f && std::isfinite(m_Stats.Noise))
+		m_Stats.EstimatedTimeLeft = std::max(0.0f, m_Stats.RenderTime * (m_Stats.Noise * m_Stats.Noise / (m_Settings.TargetNoise * m_Settings.TargetNoise) - 1.0f));
+	if (m_Settings.TargetSampleCount > 0) {
+		float timeLeft = std::max(0.0f, m_Stats.RenderTime / m_Stats.AccumulatedSampleCount * ((float)m_Settings.TargetSampleCount - m_Stats.AccumulatedSampleCount));
+		if (m_Stats.EstimatedTimeLeft < 0.0f || timeLeft < m_Stats.EstimatedTimeLeft)
+			m_Stats.EstimatedTimeLeft = timeLeft;
 	}
 
-#endif
+	if (IsTargetReached()) {
+		m_Finished = true;
+		spdlog::info("Render finished: {} spp, noise {:.4f}, {:.1f} s", m_Stats.AccumulatedSampleCount, m_Stats.Noise, m_Stats.RenderTime);
+	}
 
-	if (m_Settings.Accumulate)
-		m_FrameIndex++;
-	else
+	if (!m_Settings.Accumulate) {
 		m_FrameIndex = 1;
+		m_DiscardedFrameCount++;
+	}
 }
 
-
-glm::vec3 Renderer::PerPixel(uint32_t i) {
-	Ray ray;
-	ray.Origin = m_ActiveCamera->GetPosition();
-	ray.Direction = m_ActiveCamera->GetRayDirections()[i];
-
-	glm::vec3 incomingLight(0.0f);
-	glm::vec3 rayColor(1.0f);
-
-	uint32_t bounces = 10;
-	for (uint32_t k = 0; k < bounces; k++)
+void Renderer::RenderTile(const Tile& tile) {
+	// Summed per tile, one atomic add per pixel has every thread fighting over the counter.
+	uint32_t rayCount = 0;
+	uint32_t sampledPixelCount = 0;
+	for (uint32_t y = tile.Y; y < tile.Y + tile.Height; y++)
 	{
-		HitPayload payload = TraceRay(ray);
-		if (payload.HitDistance < 0.0f) {
-			if (m_Settings.ShowEnvironment) {
-				const Texture hdriImage = m_ActiveScene->EnvironmentImages[m_ActiveScene->SelectedEnvironment];
-				glm::vec3 environmentColor = MapRayToHDRI(ray.Direction, hdriImage);
-				rayColor *= environmentColor * m_ActiveScene->EnvironmetStrength;
-				return rayColor;
+		for (uint32_t x = tile.X; x < tile.X + tile.Width; x++)
+		{
+			uint32_t i = y * m_Width + x;
+			PixelStats& stats = m_PixelStats[i];
+			if (!m_Settings.AdaptiveSampling || !m_BlockConverged[y / AdaptiveBlockSize * m_BlockCountX + x / AdaptiveBlockSize]) {
+				glm::vec3 color = PerPixel(i, rayCount);
+				m_AccumulationImage->SetPixel(i, m_AccumulationImage->GetPixel(i) + color);
+				float luminance = Luminance(color);
+				stats.LuminanceSquaredSum += luminance * luminance;
+				stats.SampleCount++;
+				sampledPixelCount++;
 			}
-			break;
+			ResolvePixel(i);
 		}
+	}
+	m_RayCount += rayCount;
+	m_SampledPixelCount += sampledPixelCount;
+}
 
-		const Model& model = m_ActiveScene->Models[payload.ModelIndex];
-		const Mesh& mesh = model.GetMeshes()[payload.MeshIndex];
-		const Triangle& triangle = mesh.GetTriangles()[payload.TriangleIndex];
-		const Material& material = mesh.GetMaterial();
-
-		glm::vec2 interpolatedTextureCoordinates = triangle.CalculateTextureCoordinates(payload.WorldPosition);
+void Renderer::ResolvePixel(uint32_t i) {
+	const PixelStats& stats = m_PixelStats[i];
+	if (m_Settings.View == RenderView::SamplesPerPixel) {
+		float t = (float)stats.SampleCount / m_FrameIndex;
+		m_Image->SetPixel(i, glm::vec3(t, 1.0f - std::abs(2.0f * t - 1.0f), 1.0f - t));
+	}
+	else {
+		m_Image->SetPixel(i, m_AccumulationImage->GetPixel(i) / (float)stats.SampleCount);
+	}
+}
 
-		ray.Origin = payload.WorldPosition + payload.WorldNormal * 0.0001f;
-		glm::vec3 diffuseDir = glm::normalize(payload.WorldNormal + Random::InUnitSphere());
-		glm::vec3 specularDir = glm::reflect(ray.Direction, payload.WorldNormal);
+void Renderer::ForRange(uint32_t count, const std::function<void(uint32_t first, uint32_t last)>& process) {
+#if MT
+	m_Scheduler.RunRange(count, process);
+#else
+	process(0, count);
+#endif
+}
 
-		// Diffuse
-		glm::vec3 diffuseColor;
-		if (material.DiffuseTextureIndex >= 0) {
-			Texture diffuseTexture = material.Textures[material.DiffuseTextureIndex];
-			diffuseColor = diffuseTexture.SampleTexture(interpolatedTextureCoordinates);
+// One sample for every active pixel with the wavefront integrator. Instead of each path running
+// its own bounce loop, all paths advance one bounce per round of stages, so traversal and shading
+// each run over a whole queue with only their own data in cache.
+void Renderer::RenderWavefront() {
+	uint32_t pixelCount = m_Width * m_Height;
+	m_Paths.Resize(pixelCount);
+	m_RayQueues[0].Resize(pixelCount);
+	m_RayQueues[1].Resize(pixelCount);
+	uint32_t maxDepth = GetMaxDepth();
+	m_Stats.Depths.resize(maxDepth);
+
+	// Ray keys quantize origins inside the bounds of the scene.
+	AABB sceneBounds;
+	for (const MeshInstance& instance : m_ActiveScene->Instances)
+		sceneBounds.Grow(instance.Bounds);
+	glm::vec3 sceneScale = 127.0f / glm::max(sceneBounds.Max - sceneBounds.Min, glm::vec3(1e-20f));
+	if (m_Settings.SortHits) {
+		uint32_t meshCount = 0;
+		uint32_t maxTriangleCount = 1;
+		std::vector<uint32_t> firstMeshId;
+		for (const Model& model : m_ActiveScene->Models)
+		{
+			firstMeshId.push_back(meshCount);
+			meshCount += (uint32_t)model.GetMeshes().size();
+			for (const Mesh& mesh : model.GetMeshes())
+				maxTriangleCount = std::max(maxTriangleCount, (uint32_t)mesh.GetTriangles().Size());
 		}
-		else {
-			diffuseColor = material.DiffuseColor;
+		m_InstanceMeshIds.resize(m_ActiveScene->Instances.size());
+		for (size_t i = 0; i < m_InstanceMeshIds.size(); i++)
+			m_InstanceMeshIds[i] = firstMeshId[m_ActiveScene->Instances[i].ModelIndex] + m_ActiveScene->Instances[i].MeshIndex;
+		// Keys have as many bits of mesh as the scene needs, at most MaxMeshKeyBits, and triangle
+		// in the rest. The meshes past the limit share the last mesh key.
+		uint32_t meshBits = std::clamp((uint32_t)std::bit_width(meshCount), 1u, MaxMeshKeyBits);
+		if (meshCount >= (1u << meshBits) && !m_MeshKeyWarned) {
+			spdlog::warn("Hit sorting: {} meshes, the ones past {} share a sort key", meshCount, (1u << meshBits) - 2);
+			m_MeshKeyWarned = true;
 		}
+		m_TriangleKeyBits = 30 - meshBits;
+		m_TriangleKeyShift = (uint32_t)std::max(0, (int)std::bit_width(maxTriangleCount) - (int)m_TriangleKeyBits);
+	}
 
-		// Specular
-		float isSpecularBounce;
-		glm::vec3 specularColor;
-		if (material.SpecularTextureIndex >= 0) {
-			Texture specularTexture = material.Textures[material.SpecularTextureIndex];
-			isSpecularBounce = specularTexture.SampleTexture(interpolatedTextureCoordinates).r;
-			specularColor = specularTexture.SampleTexture(interpolatedTextureCoordinates);
+	ForRange(pixelCount, [this](uint32_t first, uint32_t last) { GeneratePaths(first, last); });
+	for (uint32_t depth = 0; depth < maxDepth; depth++)
+	{
+		RayQueue& queue = m_RayQueues[depth % 2];
+		RayQueue& nextQueue = m_RayQueues[(depth + 1) % 2];
+		uint32_t rayCount = queue.Size;
+		if (rayCount == 0)
+			break;
+		Stats::DepthStats& depthStats = m_Stats.Depths[depth];
+		depthStats.RayCount += rayCount;
+
+		// The primary hits are already known and the camera rays are coherent as they are.
+		if (depth > 0) {
+			Timer timer;
+			if (m_Settings.SortRays) {
+				SortQueue(queue, [&](uint32_t slot) {
+					glm::vec3 origin(queue.OriginX[slot], queue.OriginY[slot], queue.OriginZ[slot]);
+					glm::uvec3 originCell = glm::clamp((origin - sceneBounds.Min) * sceneScale, 0.0f, 127.0f);
+					glm::vec3 direction(queue.DirectionX[slot], queue.DirectionY[slot], queue.DirectionZ[slot]);
+					glm::uvec3 directionCell = glm::clamp((direction + 1.0f) * 4.0f, 0.0f, 7.0f);
+					// 21 bits of origin above 9 bits of direction.
+					return (MortonCode(originCell) << 9) | MortonCode(directionCell);
+				});
+			}
+			depthStats.SortTime += timer.ElapsedMillis();
+
+			timer.Reset();
+			ForRange(rayCount, [&](uint32_t first, uint32_t last) { ExtendPaths(queue, first, last); });
+			depthStats.ExtendTime += timer.ElapsedMillis();
+
+			timer.Reset();
+			if (m_Settings.SortHits)
+				SortQueue(queue, [&](uint32_t slot) { return GetHitKey(queue, slot); });
+			depthStats.SortTime += timer.ElapsedMillis();
 		}
-		else {
-			isSpecularBounce = material.Specular >= Random::Float(0.0f, 1.0f);
-			specularColor = material.SpecularColor;
+
+		Timer timer;
+		nextQueue.Size = 0;
+		ForRange(rayCount, [&](uint32_t first, uint32_t last) { ShadePaths(queue, nextQueue, depth, first, last); });
+		depthStats.ShadeTime += timer.ElapsedMillis();
+		m_RayCount += rayCount;
+	}
+	ForRange(pixelCount, [this](uint32_t first, uint32_t last) { AccumulatePaths(first, last); });
+}
+
+// Reorders the queue by a 30 bit key of every entry.
+void Renderer::SortQueue(RayQueue& queue, const std::function<uint32_t(uint32_t slot)>& key) {
+	uint32_t count = queue.Size;
+	m_SortKeys.resize(count);
+	m_SortOrder.resize(count);
+	ForRange(count, [&](uint32_t first, uint32_t last) {
+		for (uint32_t slot = first; slot < last; slot++)
+		{
+			m_SortKeys[slot] = key(slot);
+			m_SortOrder[slot] = slot;
 		}
+	});
+
+	RadixSortByKey(m_SortKeys, m_SortOrder, m_SortScratch[0], m_SortScratch[1]);
+
+	m_SortedQueue.Resize((uint32_t)queue.PathIndex.size());
+	ForRange(count, [&](uint32_t first, uint32_t last) { m_SortedQueue.Gather(queue, m_SortOrder, first, last); });
+	queue.SwapEntries(m_SortedQueue);
+}
+
+// Mesh, and so material, in the upper bits and the triangle below, misses go last. The highest
+// mesh key is left to the misses.
+uint32_t Renderer::GetHitKey(const RayQueue& queue, uint32_t slot) const {
+	if (queue.HitDistance[slot] < 0.0f)
+		return (1u << 30) - 1;
+	uint32_t maxMeshId = (1u << (30 - m_TriangleKeyBits)) - 2;
+	uint32_t meshId = std::min(m_InstanceMeshIds[queue.InstanceIndex[slot]], maxMeshId);
+	return (meshId << m_TriangleKeyBits) | std::min(queue.TriangleIndex[slot] >> m_TriangleKeyShift, (1u << m_TriangleKeyBits) - 1);
+}
+
+// Generate stage: starts a path with its camera ray on every pixel outside converged blocks.
+void Renderer::GeneratePaths(uint32_t first, uint32_t last) {
+	uint32_t activeCount = 0;
+	for (uint32_t i = first; i < last; i++)
+	{
+		uint32_t block = i / m_Width / AdaptiveBlockSize * m_BlockCountX + i % m_Width / AdaptiveBlockSize;
+		m_Paths.Active[i] = !m_Settings.AdaptiveSampling || !m_BlockConverged[block];
+		activeCount += m_Paths.Active[i];
+	}
+
+	RayQueue& queue = m_RayQueues[0];
+	uint32_t slot = queue.Allocate(activeCount);
+	for (uint32_t i = first; i < last; i++)
+	{
+		if (!m_Paths.Active[i])
+			continue;
+		queue.Set(slot++, i, Ray(m_ActiveCamera->GetPosition(), m_ActiveCamera->GetRayDirections()[i]), glm::vec3(1.0f), glm::vec3(0.0f));
+	}
+}
 
-		// Roughness
-		float roughness;
-		if (material.ShininessTextureIndex >= 0) {
-			Texture shininessTexture = material.Textures[material.ShininessTextureIndex];
-			glm::vec3 rgb = shininessTexture.SampleTexture(interpolatedTextureCoordinates);
-			glm::vec3 hsv = glm::hsvColor(rgb);
-			roughness = hsv.b;
+// Extend stage: closest hits of a batch of rays.
+void Renderer::ExtendPaths(RayQueue& queue, uint32_t first, uint32_t last) {
+	for (uint32_t slot = first; slot < last; slot++)
+	{
+		TLASHit hit;
+		if (m_ActiveScene->Intersect(queue.GetRay(slot), hit, m_Settings.Layout)) {
+			queue.HitDistance[slot] = hit.Distance;
+			queue.InstanceIndex[slot] = hit.InstanceIndex;
+			queue.TriangleIndex[slot] = hit.TriangleIndex;
+			queue.BarycentricU[slot] = hit.Barycentrics.x;
+			queue.BarycentricV[slot] = hit.Barycentrics.y;
 		}
 		else {
-			roughness = material.Roughness;
+			queue.HitDistance[slot] = -1.0f;
 		}
+	}
+}
 
-		// Normal
-		if (material.NormalTextureIndex >= 0) {
-			Texture normalTexture = material.Textures[material.NormalTextureIndex];
-			glm::vec3 rgb = normalTexture.SampleTexture(interpolatedTextureCoordinates);
-			ray.Direction = rgb;
-		}
-		else {
-			ray.Direction = glm::lerp(specularDir, diffuseDir, roughness);
+// Shade stage: same material evaluation as PerPixel, paths that bounce on go to the next queue.
+// The surviving paths are first packed to the front of the batch's own slots, every slot is read
+// before it can be overwritten, so they move to the next queue with one allocation and one copy.
+void Renderer::ShadePaths(RayQueue& queue, RayQueue& nextQueue, uint32_t depth, uint32_t first, uint32_t last) {
+	uint32_t bounceCount = 0;
+	uint32_t materialSwitchCount = 0;
+	uint32_t previousMesh = std::numeric_limits<uint32_t>::max();
+	for (uint32_t slot = first; slot < last; slot++)
+	{
+		uint32_t path = queue.PathIndex[slot];
+		Ray ray = queue.GetRay(slot);
+		glm::vec3 throughput = queue.GetThroughput(slot);
+
+		HitPayload payload;
+		if (depth == 0)
+			payload = m_PrimaryHits[path];
+		else if (queue.HitDistance[slot] < 0.0f)
+			payload = Miss(ray);
+		else
+			payload = ClosestHit(ray, queue.GetHit(slot));
+
+		// Misses count as one more material, the environment.
+		uint32_t mesh = payload.HitDistance < 0.0f ? std::numeric_limits<uint32_t>::max() - 1 : (payload.ModelIndex << 16) | payload.MeshIndex;
+		materialSwitchCount += slot > first && mesh != previousMesh;
+		previousMesh = mesh;
+
+		if (payload.HitDistance < 0.0f) {
+			glm::vec3 radiance = queue.GetRadiance(slot);
+			if (m_Settings.ShowEnvironment)
+				radiance += throughput * EnvironmentLight(ray);
+			m_Paths.SetRadiance(path, radiance);
+			continue;
 		}
 
-		incomingLight += material.GetEmission() * rayColor;
-		rayColor *= glm::lerp(diffuseColor, specularColor, isSpecularBounce);
+		glm::vec3 radiance = queue.GetRadiance(slot);
+		Sampler sampler = GetSampler(path, depth);
+		Scatter(payload, ray, radiance, throughput, sampler);
+		if (ContinuePath(depth, throughput, sampler))
+			queue.Set(first + bounceCount++, path, ray, throughput, radiance);
+		else
+			m_Paths.SetRadiance(path, radiance);
 	}
-	return incomingLight;
+
+	m_MaterialSwitchCount[depth] += materialSwitchCount;
+
+	nextQueue.CopyPaths(queue, first, bounceCount, nextQueue.Allocate(bounceCount));
 }
 
-Renderer::HitPayload Renderer::TraceRay(const Ray& ray) {
-#define BVH 1 // BoundingVolumeHierarchy
-#if BVH
-	int closestModelIndex = -1;
-	int closestMeshIndex = -1;
-	Triangle tri;
-	float hitDistance = std::numeric_limits<float>::max();
-
-	//std::vector<Triangle> triangles;
-	for (uint32_t i = 0; i < m_ActiveScene->Models.size(); i++)
+// Accumulate stage, the connect of this integrator: adds the finished paths to their pixels.
+// There is no light sampling, so paths need no shadow rays to connect to a light.
+void Renderer::AccumulatePaths(uint32_t first, uint32_t last) {
+	uint32_t sampledPixelCount = 0;
+	for (uint32_t i = first; i < last; i++)
 	{
-		const Model& model = m_ActiveScene->Models[i];
-		if (!model.IntersectsWithRay(ray.Origin, ray.Direction)) {
-			continue;
+		if (m_Paths.Active[i]) {
+			glm::vec3 color = m_Paths.GetRadiance(i);
+			m_AccumulationImage->SetPixel(i, m_AccumulationImage->GetPixel(i) + color);
+			PixelStats& stats = m_PixelStats[i];
+			float luminance = Luminance(color);
+			stats.LuminanceSquaredSum += luminance * luminance;
+			stats.SampleCount++;
+			sampledPixelCount++;
 		}
-		for (uint32_t j = 0; j < model.GetMeshes().size(); j++)
+		ResolvePixel(i);
+	}
+	m_SampledPixelCount += sampledPixelCount;
+}
+
+// Measures the standard error of each block's mean luminance relative to the mean and marks the
+// block converged when it is below the threshold. Runs between passes, so no pixel statistics
+// change meanwhile.
+void Renderer::UpdateConvergence(const Tile& blocks) {
+	uint32_t convergedPixelCount = 0;
+	for (uint32_t by = blocks.Y; by < blocks.Y + blocks.Height; by++)
+	{
+		for (uint32_t bx = blocks.X; bx < blocks.X + blocks.Width; bx++)
 		{
-			const Mesh& mesh = model.GetMeshes()[j];
-			std::vector<Triangle> triangles = IntersectWithBVH(mesh.GetBVH(), ray.Origin, ray.Direction);
-			for (uint32_t k = 0; k < triangles.size(); k++)
+			uint32_t lastX = std::min((bx + 1) * AdaptiveBlockSize, m_Width);
+			uint32_t lastY = std::min((by + 1) * AdaptiveBlockSize, m_Height);
+			uint32_t minSampleCount = std::numeric_limits<uint32_t>::max();
+			float meanSum = 0.0f;
+			float errorSquaredSum = 0.0f;
+			for (uint32_t y = by * AdaptiveBlockSize; y < lastY && minSampleCount >= 2; y++)
 			{
-				const Triangle& triangle = triangles[k];
-				float t;
-				if (triangle.IntersectsWithRay(ray.Origin, ray.Direction, t)) {
-					if (hitDistance > t) {
-						hitDistance = t;
-						closestModelIndex = i;
-						closestMeshIndex = j;
-						tri = triangle;
-					}
+				for (uint32_t x = bx * AdaptiveBlockSize; x < lastX; x++)
+				{
+					uint32_t i = y * m_Width + x;
+					const PixelStats& stats = m_PixelStats[i];
+					minSampleCount = std::min(minSampleCount, stats.SampleCount);
+					if (minSampleCount < 2)
+						break;
+					float n = (float)stats.SampleCount;
+					float mean = Luminance(m_AccumulationImage->GetPixel(i)) / n;
+					float variance = std::max(0.0f, stats.LuminanceSquaredSum / n - mean * mean) * n / (n - 1.0f);
+					meanSum += mean;
+					errorSquaredSum += variance / n;
 				}
 			}
+
+			uint32_t block = by * m_BlockCountX + bx;
+			uint32_t pixelCount = (lastX - bx * AdaptiveBlockSize) * (lastY - by * AdaptiveBlockSize);
+			if (minSampleCount < 2) {
+				m_BlockError[block] = std::numeric_limits<float>::infinity();
+				m_BlockConverged[block] = false;
+				continue;
+			}
+			m_BlockError[block] = std::sqrt(errorSquaredSum / pixelCount) / std::max(meanSum / pixelCount, 1e-3f);
+			m_BlockConverged[block] = m_Settings.AdaptiveSampling && minSampleCount >= m_Settings.AdaptiveMinSamples
+				&& m_BlockError[block] < m_Settings.AdaptiveThreshold;
+			if (m_BlockConverged[block])
+				convergedPixelCount += pixelCount;
 		}
 	}
-	if (closestMeshIndex < 0)
+	m_ConvergedPixelCount += convergedPixelCount;
+}
+
+// Runs UpdateConvergence over all blocks and averages their errors into the noise metric.
+void Renderer::UpdateNoise() {
+	m_ConvergedPixelCount = 0;
+	uint32_t blockCountY = (uint32_t)m_BlockError.size() / m_BlockCountX;
+#if MT
+	m_Scheduler.Run(m_BlockCountX, blockCountY, [this](const Tile& blocks) { UpdateConvergence(blocks); });
+#else
+	UpdateConvergence({ 0, 0, m_BlockCountX, blockCountY });
+#endif
+	double errorSum = 0.0;
+	for (float error : m_BlockError)
+		errorSum += error;
+	m_Stats.Noise = (float)(errorSum / m_BlockError.size());
+	m_Stats.ConvergedPixelShare = (float)m_ConvergedPixelCount / ((size_t)m_Width * m_Height);
+}
+
+bool Renderer::IsTargetReached() const {
+	if (!m_Settings.Accumulate || m_FrameIndex == 1)
+		return false;
+	if (m_Settings.TargetSampleCount > 0 && m_FrameIndex - 1 >= m_Settings.TargetSampleCount)
+		return true;
+	if (m_Settings.TargetNoise > 0.0f && m_Stats.Noise <= m_Settings.TargetNoise)
+		return true;
+	// Nothing left to sample.
+	return m_Settings.AdaptiveSampling && m_Stats.ConvergedPixelShare >= 1.0f;
+}
+
+void Renderer::TracePrimaryRays() {
+	m_PrimaryHits.resize((size_t)m_Width * m_Height);
+
+	uint32_t packetSize = m_Settings.PacketSize;
+	if (packetSize == 8 && !SIMD::SupportsAVX2())
+		packetSize = 4;
+	const uint32_t tileWidth = packetSize == 8 ? 4 : (packetSize == 4 ? 2 : 1);
+	const uint32_t tileHeight = packetSize > 1 ? 2 : 1;
+
+	auto traceRow = [this, packetSize, tileWidth](uint32_t y, uint32_t firstX, uint32_t lastX) {
+		for (uint32_t x = firstX; x < lastX; x += tileWidth)
+		{
+			if (packetSize == 8)
+				TracePrimaryPacket<8>(x, y);
+			else if (packetSize == 4)
+				TracePrimaryPacket<4>(x, y);
+			else
+				m_PrimaryHits[y * m_Width + x] = TraceRay(Ray(m_ActiveCamera->GetPosition(), m_ActiveCamera->GetRayDirections()[y * m_Width + x]));
+		}
+	};
+#if MT
+	// Scheduler tiles start on packet boundaries, packets running past the image are masked off.
+	m_Scheduler.Run(m_Width, m_Height, [&](const Tile& tile) {
+		for (uint32_t y = tile.Y; y < tile.Y + tile.Height; y += tileHeight)
+			traceRow(y, tile.X, tile.X + tile.Width);
+	});
+#else
+	for (uint32_t y = 0; y < m_Height; y += tileHeight)
+		traceRow(y, 0, m_Width);
+#endif
+}
+
+// Traces the primary rays of a Width / 2 x 2 pixel tile starting at x, y as one packet.
+template<uint32_t Width>
+void Renderer::TracePrimaryPacket(uint32_t x, uint32_t y) {
+	constexpr uint32_t tileWidth = Width / 2;
+	RayPacket<Width> packet;
+	uint32_t pixels[Width];
+	for (uint32_t lane = 0; lane < Width; lane++)
+	{
+		uint32_t pixelX = x + lane % tileWidth;
+		uint32_t pixelY = y + lane / tileWidth;
+		if (pixelX >= m_Width || pixelY >= m_Height)
+			continue;
+		pixels[lane] = pixelY * m_Width + pixelX;
+		packet.Set(lane, Ray(m_ActiveCamera->GetPosition(), m_ActiveCamera->GetRayDirections()[pixels[lane]]));
+	}
+
+	// Tiles straddling an axis of the camera frame have mixed direction signs.
+	if (!packet.IsCoherent()) {
+		m_PacketFallbackCount += std::popcount(packet.ActiveMask);
+		for (uint32_t lanes = packet.ActiveMask; lanes; lanes &= lanes - 1)
+		{
+			uint32_t lane = (uint32_t)std::countr_zero(lanes);
+			m_PrimaryHits[pixels[lane]] = TraceRay(packet.Rays[lane]);
+		}
+		return;
+	}
+
+	TLASHit hits[Width];
+	uint32_t hitMask = m_ActiveScene->IntersectPacket(packet, hits, m_Settings.Layout);
+	for (uint32_t lanes = packet.ActiveMask; lanes; lanes &= lanes - 1)
+	{
+		uint32_t lane = (uint32_t)std::countr_zero(lanes);
+		if (hitMask & (1u << lane))
+			m_PrimaryHits[pixels[lane]] = ClosestHit(packet.Rays[lane], hits[lane]);
+		else
+			m_PrimaryHits[pixels[lane]] = Miss(packet.Rays[lane]);
+	}
+}
+
+glm::vec3 Renderer::PerPixel(uint32_t i, uint32_t& rayCount) {
+	Ray ray(m_ActiveCamera->GetPosition(), m_ActiveCamera->GetRayDirections()[i]);
+
+	glm::vec3 incomingLight(0.0f);
+	glm::vec3 rayColor(1.0f);
+
+	for (uint32_t k = 0; k < GetMaxDepth(); k++)
+	{
+		HitPayload payload = k == 0 ? m_PrimaryHits[i] : TraceRay(ray);
+		rayCount++;
+		if (payload.HitDistance < 0.0f) {
+			if (m_Settings.ShowEnvironment)
+				incomingLight += rayColor * EnvironmentLight(ray);
+			break;
+		}
+
+		Sampler sampler = GetSampler(i, k);
+		Scatter(payload, ray, incomingLight, rayColor, sampler);
+		if (!ContinuePath(k, rayColor, sampler))
+			break;
+	}
+	return incomingLight;
+}
+
+// Whether the path traces another ray after the one of the given depth, reweights rayColor when
+// Russian roulette lets it live. Takes the next sampler dimension after Scatter.
+bool Renderer::ContinuePath(uint32_t depth, glm::vec3& rayColor, Sampler& sampler) const {
+	if (depth + 1 >= GetMaxDepth())
+		return false;
+	float survival = glm::max(rayColor.r, glm::max(rayColor.g, rayColor.b));
+	if (survival <= 0.0f)
+		return false;
+	if (!m_Settings.RussianRoulette || depth + 1 < m_Settings.RouletteMinDepth || survival >= 1.0f)
+		return true;
+	if (sampler.Get1D() >= survival)
+		return false;
+	rayColor /= survival;
+	return true;
+}
+
+// Sample values for the given bounce of the path pixel i takes this sample.
+Sampler Renderer::GetSampler(uint32_t i, uint32_t bounce) const {
+	return Sampler(m_Settings.Sampler, i % m_Width, i / m_Width, m_PixelStats[i].SampleCount,
+		m_Settings.Seed + m_DiscardedFrameCount, bounce * Sampler::DimensionsPerBounce);
+}
+
+// Adds the light emitted at the hit and replaces ray with the bounce off the surface.
+void Renderer::Scatter(const HitPayload& payload, Ray& ray, glm::vec3& incomingLight, glm::vec3& rayColor, Sampler& sampler) const {
+	const Model& model = m_ActiveScene->Models[payload.ModelIndex];
+	const Mesh& mesh = model.GetMeshes()[payload.MeshIndex];
+	const Material& material = mesh.GetMaterial();
+
+	glm::vec2 interpolatedTextureCoordinates = mesh.InterpolateTexCoord(payload.TriangleIndex, payload.Barycentrics);
+
+	glm::vec3 origin = payload.WorldPosition + payload.WorldNormal * 0.0001f;
+	glm::vec3 diffuseDir = glm::normalize(payload.WorldNormal + SampleUnitSphere(sampler.Get2D()));
+	glm::vec3 specularDir = glm::reflect(ray.Direction, payload.WorldNormal);
+
+	// Diffuse
+	glm::vec3 diffuseColor;
+	if (material.DiffuseTextureIndex >= 0) {
+		const Texture& diffuseTexture = material.Textures[material.DiffuseTextureIndex];
+		diffuseColor = diffuseTexture.SampleTexture(interpolatedTextureCoordinates);
+	}
+	else {
+		diffuseColor = material.DiffuseColor;
+	}
+
+	// Specular
+	float isSpecularBounce;
+	glm::vec3 specularColor;
+	if (material.SpecularTextureIndex >= 0) {
+		const Texture& specularTexture = material.Textures[material.SpecularTextureIndex];
+		isSpecularBounce = specularTexture.SampleTexture(interpolatedTextureCoordinates).r;
+		specularColor = specularTexture.SampleTexture(interpolatedTextureCoordinates);
+	}
+	else {
+		isSpecularBounce = material.Specular >= sampler.Get1D();
+		specularColor = material.SpecularColor;
+	}
+
+	// Roughness
+	float roughness;
+	if (material.ShininessTextureIndex >= 0) {
+		const Texture& shininessTexture = material.Textures[material.ShininessTextureIndex];
+		glm::vec3 rgb = shininessTexture.SampleTexture(interpolatedTextureCoordinates);
+		glm::vec3 hsv = glm::hsvColor(rgb);
+		roughness = hsv.b;
+	}
+	else {
+		roughness = material.Roughness;
+	}
+
+	// Normal
+	if (material.NormalTextureIndex >= 0) {
+		const Texture& normalTexture = material.Textures[material.NormalTextureIndex];
+		glm::vec3 rgb = normalTexture.SampleTexture(interpolatedTextureCoordinates);
+		ray = Ray(origin, rgb);
+	}
+	else {
+		ray = Ray(origin, glm::lerp(specularDir, diffuseDir, roughness));
+	}
+
+	incomingLight += material.GetEmission() * rayColor;
+	rayColor *= glm::lerp(diffuseColor, specularColor, isSpecularBounce);
+}
+
+glm::vec3 Renderer::EnvironmentLight(const Ray& ray) const {
+	const Texture& hdriImage = m_ActiveScene->EnvironmentImages[m_ActiveScene->SelectedEnvironment];
+	return MapRayToHDRI(ray.Direction, hdriImage) * m_ActiveScene->EnvironmetStrength;
+}
+
+Renderer::HitPayload Renderer::TraceRay(const Ray& ray) {
+#define USE_BVH 1 // BoundingVolumeHierarchy
+#if USE_BVH
+	TLASHit hit;
+	if (!m_ActiveScene->Intersect(ray, hit, m_Settings.Layout))
 		return Miss(ray);
 
-	return ClosestHit(ray, hitDistance, closestModelIndex, closestMeshIndex, tri);
+	return ClosestHit(ray, hit);
 
 #else
-	int closestModelIndex = -1;
-	int closestMeshIndex = -1;
-	int triangleIndex = -1;
-	float hitDistance = std::numeric_limits<float>::max();
+	TLASHit hit;
+	bool found = false;
 
-	for (uint32_t i = 0; i < m_ActiveScene->Models.size(); i++)
+	for (uint32_t i = 0; i < m_ActiveScene->Instances.size(); i++)
 	{
-		const Model& model = m_ActiveScene->Models[i];
-		for (uint32_t j = 0; j < model.GetMeshes().size(); j++)
+		const MeshInstance& instance = m_ActiveScene->Instances[i];
+		const Mesh& mesh = m_ActiveScene->Models[instance.ModelIndex].GetMeshes()[instance.MeshIndex];
+		Ray localRay = instance.ToObjectSpace(ray);
+		if (!mesh.GetAABB().IntersectsWithRay(localRay.Origin, localRay.Direction))
+			continue;
+		for (uint32_t k = 0; k < mesh.GetTriangles().Size(); k++)
 		{
-			const Mesh& mesh = model.GetMeshes()[j];
-			if (!mesh.GetAABB().IntersectsWithRay(ray.Origin, ray.Direction))
-				continue;
-			for (uint32_t k = 0; k < mesh.GetTriangles().size(); k++)
-			{
-				const Triangle& triangle = mesh.GetTriangles()[k];
-				float t;
-				if (triangle.IntersectsWithRay(ray.Origin, ray.Direction, t)) {
-					if (t < hitDistance) {
-						hitDistance = t;
-						closestModelIndex = i;
-						closestMeshIndex = j;
-						triangleIndex = k;
-					}
+			float t;
+			glm::vec2 barycentrics;
+			if (mesh.GetTriangles().Intersect(k, localRay, t, barycentrics)) {
+				if (t < hit.Distance) {
+					hit.Distance = t;
+					hit.InstanceIndex = i;
+					hit.TriangleIndex = k;
+					hit.Barycentrics = barycentrics;
+					found = true;
 				}
 			}
 		}
 	}
-	if (closestMeshIndex < 0)
+	if (!found)
 		return Miss(ray);
 
-	return ClosestHit(ray, hitDistance, closestModelIndex, closestMeshIndex, triangleIndex);
+	return ClosestHit(ray, hit);
 #endif
 }
 
-Renderer::HitPayload Renderer::ClosestHit(const Ray& ray, float hitDistance, uint32_t modelIndex, uint32_t meshIndex, uint32_t triangleIndex) {
-	HitPayload payload;
-	payload.HitDistance = hitDistance;
-	payload.ModelIndex = modelIndex;
-	payload.MeshIndex = meshIndex;
-	payload.TriangleIndex = triangleIndex;
+Renderer::HitPayload Renderer::ClosestHit(const Ray& ray, const TLASHit& hit) {
+	const MeshInstance& instance = m_ActiveScene->Instances[hit.InstanceIndex];
 
-	const Model& model = m_ActiveScene->Models[modelIndex];
-	const Mesh& mesh = model.GetMeshes()[meshIndex];
-	payload.WorldPosition = ray.Direction * hitDistance + ray.Origin;
-	payload.WorldNormal = mesh.GetTriangles()[triangleIndex].A.Normal;
+	HitPayload payload;
+	payload.HitDistance = hit.Distance;
+	payload.InstanceIndex = hit.InstanceIndex;
+	payload.ModelIndex = instance.ModelIndex;
+	payload.MeshIndex = instance.MeshIndex;
+	payload.TriangleIndex = hit.TriangleIndex;
+	payload.Barycentrics = hit.Barycentrics;
+
+	const Model& model = m_ActiveScene->Models[instance.ModelIndex];
+	const Mesh& mesh = model.GetMeshes()[instance.MeshIndex];
+	payload.WorldPosition = ray.Direction * hit.Distance + ray.Origin;
+	payload.WorldNormal = glm::normalize(instance.NormalMatrix * mesh.GetTriangleVertex(hit.TriangleIndex, 0).Normal);
 
 	return payload;
 }
@@ -260,45 +736,11 @@ Renderer::HitPayload Renderer::Miss(const Ray& ray) {
 	return payload;
 }
 
-glm::vec3 Renderer::MapRayToHDRI(glm::vec3 rayDirection, const Texture& hdriImage) {
+glm::vec3 Renderer::MapRayToHDRI(glm::vec3 rayDirection, const Texture& hdriImage) const {
 	// Convert ray direction to spherical coordinates
-	float theta = std::acos(rayDirection.y);  // Zenith angle
+	rayDirection = glm::normalize(rayDirection); // Bounces lerp between two directions
+	float theta = std::acos(glm::clamp(rayDirection.y, -1.0f, 1.0f));  // Zenith angle
 	float phi = std::atan2(rayDirection.x, rayDirection.z) + glm::radians(m_ActiveScene->EnvironmentRotation);  // Azimuth angle
 
 	return hdriImage.SampleSphericalTexture(phi, theta);
 }
-
-std::vector<Triangle> Renderer::IntersectWithBVH(BVHNode* node, const glm::vec3& origin, const glm::vec3& direction) const {
-	std::vector<Triangle> intersectedTriangles;
-
-	if (!node->BoundingBox.IntersectsWithRay(origin, direction)) {
-		// No intersection with this node's bounding volume, exit early.
-		return {};
-	}
-
-	if (node->IsLeaf) {
-		return node->Triangles;
-	}
-	else {
-		// Internal node, recursively traverse the children.
-		std::vector<Triangle> leftTriangles = IntersectWithBVH(node->Left, origin, direction);
-		std::vector<Triangle> rightTriangles = IntersectWithBVH(node->Right, origin, direction);
-		
-		// Combine the triangles from both children.
-		intersectedTriangles.insert(intersectedTriangles.end(), leftTriangles.begin(), leftTriangles.end());
-		intersectedTriangles.insert(intersectedTriangles.end(), rightTriangles.begin(), rightTriangles.end());
-	}
-	return intersectedTriangles;
-}
-
-Renderer::HitPayload Renderer::ClosestHit(const Ray& ray, float hitDistance, uint32_t modelIndex, uint32_t meshIndex, Triangle triangle) {
-	HitPayload payload;
-	payload.HitDistance = hitDistance;
-	payload.ModelIndex = modelIndex;
-	payload.MeshIndex = meshIndex;
-
-	payload.WorldPosition = ray.Direction * hitDistance + ray.Origin;
-	payload.WorldNormal = triangle.A.Normal;
-
-	return payload;
-}
@@ -4,12 +4,94 @@
 #include "Scene.h"
 #include "Ray.h"
 #include "Camera.h"
+#include "TileScheduler.h"
+#include "Wavefront.h"
+#include "Sampler.h"
+
+#include <algorithm>
+#include <atomic>
+
+enum class RenderIntegrator {
+	Megakernel, // Every pixel runs its whole path in one loop
+	Wavefront // All paths advance a bounce at a time through batched stages over SoA queues
+};
+
+enum class RenderView {
+	Color,
+	SamplesPerPixel // Heatmap of the samples each pixel took relative to the most possible
+};
 
 class Renderer {
 public:
 	struct Settings {
 		bool Accumulate = true;
 		bool ShowEnvironment = true;
+		BVHLayout Layout = BVHLayout::Wide4;
+		// Primary rays traced together in 2x2 (4) or 4x2 (8, AVX2) pixel tiles, 1 traces them one by one.
+		uint32_t PacketSize = 8;
+		RenderIntegrator Integrator = RenderIntegrator::Megakernel;
+		// Wavefront only: after the first bounce, rays are sorted by a Morton key of origin and direction
+		// before traversal, and hits by mesh (so material) and triangle before shading. Hit keys have
+		// 30 bits, the mesh takes what the scene needs up to 20 (about a million meshes, the rest share
+		// one key), the triangle the rest, so huge meshes sort their triangles more coarsely.
+		bool SortRays = false;
+		bool SortHits = false;
+		// Samples per pixel are taken until the next one would not fit in this many ms, 0 takes one per frame.
+		float FrameBudget = 0.0f;
+		// 8x8 pixel blocks stop taking samples once the standard error of their mean luminance,
+		// relative to the mean, drops below AdaptiveThreshold. Pixels always take AdaptiveMinSamples first.
+		bool AdaptiveSampling = true;
+		float AdaptiveThreshold = 0.01f;
+		uint32_t AdaptiveMinSamples = 16;
+		RenderView View = RenderView::Color;
+		// Accumulation stops once the noise metric or the samples per pixel reach these, 0 disables them.
+		float TargetNoise = 0.0f;
+		uint32_t TargetSampleCount = 0;
+		// Sample values are a function of the seed, pixel, sample and bounce, so an image does not
+		// depend on the thread count or the integrator.
+		SamplerType Sampler = SamplerType::Sobol;
+		uint32_t Seed = 0;
+		// Paths end after MaxDepth rays (at most MaxDepthLimit), or once their throughput is black.
+		// From RouletteMinDepth rays on, Russian roulette ends a path with probability 1 minus its
+		// largest throughput component and divides the survivors by the probability they lived with.
+		uint32_t MaxDepth = 10;
+		bool RussianRoulette = true;
+		uint32_t RouletteMinDepth = 3;
+	};
+
+	struct Stats {
+		float FrameTime = 0.0f; // ms
+		uint32_t SampleCount = 0; // Passes over the image this frame, converged pixels skip them
+		float MSamplesPerSecond = 0.0f;
+		float ConvergedPixelShare = 0.0f;
+		// Average relative standard error of the 8x8 blocks, infinite until every pixel has two samples.
+		float Noise = 0.0f;
+		uint32_t AccumulatedSampleCount = 0;
+		float RenderTime = 0.0f; // s since the accumulation was reset
+		float EstimatedTimeLeft = -1.0f; // s until a target is reached, negative without one
+		uint64_t RayCount = 0;
+		float MRaysPerSecond = 0.0f;
+		float AveragePathLength = 0.0f; // Rays per sample, the primary ray included
+		// Primary rays are traced in a pass of their own before the bounces, once per frame since
+		// they are the same for every sample.
+		float PrimaryTime = 0.0f; // ms
+		float PrimaryMRaysPerSecond = 0.0f;
+		float SecondaryMRaysPerSecond = 0.0f;
+		uint64_t PacketFallbackCount = 0; // Primary rays traced alone because their packet was incoherent
+		// Tile scheduling over both passes, utilization is the share of the frame a thread spent rendering.
+		uint32_t TileCount = 0;
+		uint32_t StolenTileCount = 0;
+		uint32_t SplitTileCount = 0;
+		std::vector<float> ThreadUtilization;
+		// Wavefront stages per bounce, summed over the passes of the frame.
+		struct DepthStats {
+			uint64_t RayCount = 0;
+			float SortTime = 0.0f; // ms
+			float ExtendTime = 0.0f; // ms
+			float ShadeTime = 0.0f; // ms
+			float MaterialSwitchRate = 0.0f; // Share of shaded rays on another mesh than the ray before
+		};
+		std::vector<DepthStats> Depths;
 	};
 public:
 	Renderer() = default;
@@ -22,42 +104,94 @@ public:
 
 	void ResetFrameIndex() { m_FrameIndex = 1; }
 	Settings& GetSettings() { return m_Settings; }
+	const Stats& GetStats() const { return m_Stats; }
+	// A target was reached and Render leaves the image alone.
+	bool IsFinished() const { return m_Finished; }
 
 private:
 	struct HitPayload {
 		float HitDistance;
 		glm::vec3 WorldNormal;
 		glm::vec3 WorldPosition;
+		glm::vec2 Barycentrics;
+		uint32_t InstanceIndex;
 		uint32_t ModelIndex;
 		uint32_t MeshIndex;
 		uint32_t TriangleIndex;
 	};
 
-	glm::vec3 PerPixel(uint32_t i);
+	void TracePrimaryRays();
+	void RenderTile(const Tile& tile);
+	void ResolvePixel(uint32_t i);
+	void ForRange(uint32_t count, const std::function<void(uint32_t first, uint32_t last)>& process);
+	void RenderWavefront();
+	void GeneratePaths(uint32_t first, uint32_t last);
+	void ExtendPaths(RayQueue& queue, uint32_t first, uint32_t last);
+	void ShadePaths(RayQueue& queue, RayQueue& nextQueue, uint32_t depth, uint32_t first, uint32_t last);
+	void AccumulatePaths(uint32_t first, uint32_t last);
+	void SortQueue(RayQueue& queue, const std::function<uint32_t(uint32_t slot)>& key);
+	uint32_t GetHitKey(const RayQueue& queue, uint32_t slot) const;
+	void UpdateConvergence(const Tile& blocks);
+	void UpdateNoise();
+	bool IsTargetReached() const;
+	template<uint32_t Width>
+	void TracePrimaryPacket(uint32_t x, uint32_t y);
+	glm::vec3 PerPixel(uint32_t i, uint32_t& rayCount);
+	Sampler GetSampler(uint32_t i, uint32_t bounce) const;
+	void Scatter(const HitPayload& payload, Ray& ray, glm::vec3& incomingLight, glm::vec3& rayColor, Sampler& sampler) const;
+	bool ContinuePath(uint32_t depth, glm::vec3& rayColor, Sampler& sampler) const;
+	uint32_t GetMaxDepth() const { return std::clamp(m_Settings.MaxDepth, 1u, MaxDepthLimit); }
+	glm::vec3 EnvironmentLight(const Ray& ray) const;
 	HitPayload TraceRay(const Ray& ray);
-	HitPayload ClosestHit(const Ray& ray, float hitDistance, uint32_t modelIndex, uint32_t meshIndex, uint32_t triangleIndex);
-	HitPayload ClosestHit(const Ray& ray, float hitDistance, uint32_t modelIndex, uint32_t meshIndex, Triangle triangle);
+	HitPayload ClosestHit(const Ray& ray, const TLASHit& hit);
 	HitPayload Miss(const Ray& ray);
 
-	glm::vec3 MapRayToHDRI(glm::vec3 rayDirection, const Texture& hdriImage);
-
-	std::vector<Triangle> IntersectWithBVH(BVHNode* node, const glm::vec3& origin, const glm::vec3& direction) const;
+	glm::vec3 MapRayToHDRI(glm::vec3 rayDirection, const Texture& hdriImage) const;
 private:
+	static constexpr uint32_t MaxDepthLimit = 64;
+	static constexpr uint32_t MaxMeshKeyBits = 20;
+
 	Settings m_Settings;
+	Stats m_Stats;
+	std::atomic<uint64_t> m_RayCount = 0;
+	std::atomic<uint64_t> m_PacketFallbackCount = 0;
+	std::atomic<uint64_t> m_SampledPixelCount = 0;
+	std::atomic<uint64_t> m_ConvergedPixelCount = 0;
+	std::vector<HitPayload> m_PrimaryHits;
+	TileScheduler m_Scheduler;
+	PathResults m_Paths;
+	RayQueue m_RayQueues[2]; // Rays of the current bounce and the next
+	RayQueue m_SortedQueue;
+	std::vector<uint32_t> m_SortKeys, m_SortOrder, m_SortScratch[2];
+	std::vector<uint32_t> m_InstanceMeshIds; // Scene wide mesh index of every instance, for the hit keys
+	uint32_t m_TriangleKeyBits = 20;
+	uint32_t m_TriangleKeyShift = 0;
+	bool m_MeshKeyWarned = false;
+	std::atomic<uint64_t> m_MaterialSwitchCount[MaxDepthLimit] = {};
 
 	Image* m_Image = nullptr;
 	Image* m_AccumulationImage = nullptr;
 
+	// Kept next to the accumulation image, pixels have their own sample counts with adaptive sampling.
+	struct PixelStats {
+		float LuminanceSquaredSum = 0.0f;
+		uint32_t SampleCount = 0;
+	};
+	std::vector<PixelStats> m_PixelStats;
+	// Adaptive sampling decides per block, single pixels that never saw a light after a few samples
+	// look converged on their own.
+	static constexpr uint32_t AdaptiveBlockSize = 8;
+	std::vector<uint8_t> m_BlockConverged;
+	std::vector<float> m_BlockError;
+	uint32_t m_BlockCountX = 0;
+
 	const Scene* m_ActiveScene = nullptr;
 	const Camera* m_ActiveCamera = nullptr;
 
 	uint32_t m_FrameIndex = 1;
+	uint32_t m_DiscardedFrameCount = 0; // Frames rendered without accumulation, each gets new noise
+	bool m_Finished = false;
 
 	uint32_t m_Width = 1000;
 	uint32_t m_Height = 600;
-
-	std::vector<uint32_t> m_ImageHorizontalIter;
-	std::vector<uint32_t> m_ImageVerticalIter;
-
-	bool m_First = true;
 };
\ No newline at end of file
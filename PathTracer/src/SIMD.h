@@ -0,0 +1,38 @@
+#pragma once
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+// MSVC emits AVX instructions for the intrinsics regardless of /arch.
+#define PT_TARGET_AVX2
+#else
+// No fma, GCC would contract multiply-adds and the results would differ from the SSE paths.
+#define PT_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace SIMD {
+
+	// The 8 wide code paths may only run when both the CPU and the OS support AVX2.
+	inline bool SupportsAVX2() {
+#if defined(_MSC_VER)
+		static const bool supported = []() {
+			int info[4];
+			__cpuid(info, 0);
+			if (info[0] < 7)
+				return false;
+			__cpuid(info, 1);
+			bool osxsave = info[2] & (1 << 27);
+			bool avx = info[2] & (1 << 28);
+			__cpuidex(info, 7, 0);
+			bool avx2 = info[1] & (1 << 5);
+			return osxsave && avx && avx2 && (_xgetbv(0) & 6) == 6;
+		}();
+		return supported;
+#else
+		static const bool supported = __builtin_cpu_supports("avx2");
+		return supported;
+#endif
+	}
+
+}
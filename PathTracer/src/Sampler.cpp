@@ -0,0 +1,221 @@
+#include "Sampler.h"
+#include "Utils.h"
+
+#include <glm/gtc/constants.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+static uint32_t ReverseBits(uint32_t v) {
+	v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+	v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+	v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+	v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+	return (v >> 16) | (v << 16);
+}
+
+// Laine-Karras permutation with the constants of Burley, "Practical Hash-based Owen Scrambling".
+// Every bit is flipped depending only on the bits below it, on bit reversed values this is Owen
+// scrambling in base 2. The top n bits of the reversed value are permuted among themselves.
+static uint32_t LaineKarrasPermutation(uint32_t v, uint32_t seed) {
+	v += seed;
+	v ^= v * 0x6c50b47cu;
+	v ^= v * 0xb82f1e52u;
+	v ^= v * 0xc7afe638u;
+	v ^= v * 0x8d22f6e6u;
+	return v;
+}
+
+// Second dimension of the Sobol sequence with its bits reversed, all its direction numbers are
+// m = 1. Looked up a byte of the index at a time instead of looping over all 32 bits.
+static uint32_t SobolReversed(uint32_t index) {
+	static const std::vector<uint32_t> table = []() {
+		std::vector<uint32_t> directions(32);
+		for (uint32_t bit = 0, v = 1u << 31; bit < 32; bit++, v ^= v >> 1)
+			directions[bit] = ReverseBits(v);
+		std::vector<uint32_t> values(4 * 256, 0);
+		for (uint32_t byte = 0; byte < 4; byte++)
+		{
+			for (uint32_t b = 0; b < 256; b++)
+			{
+				for (uint32_t bit = 0; bit < 8; bit++)
+					if (b & (1u << bit))
+						values[byte * 256 + b] ^= directions[byte * 8 + bit];
+			}
+		}
+		return values;
+	}();
+	return table[index & 255] ^ table[256 + ((index >> 8) & 255)] ^ table[512 + ((index >> 16) & 255)] ^ table[768 + (index >> 24)];
+}
+
+static float ToFloat(uint32_t v) { return (float)(v >> 8) * (1.0f / 16777216.0f); }
+
+// Ranks of a 64x64 tile of blue noise, made once by void and cluster (Ulichney 1993). Points
+// go one by one into the largest void of the ones before them, so every prefix of the ranks
+// is evenly spread and the tile as a whole has no low frequencies.
+static const std::vector<float>& GetBlueNoiseTile() {
+	static const std::vector<float> tile = []() {
+		constexpr int Size = 64;
+		constexpr int Count = Size * Size;
+		constexpr float Sigma = 1.5f;
+
+		// Beyond 4 sigma the Gaussian adds nothing a float would notice next to the closer points.
+		constexpr int Radius = 6;
+		float kernel[2 * Radius + 1][2 * Radius + 1];
+		for (int dy = -Radius; dy <= Radius; dy++)
+		{
+			for (int dx = -Radius; dx <= Radius; dx++)
+				kernel[dy + Radius][dx + Radius] = std::exp(-(float)(dx * dx + dy * dy) / (2.0f * Sigma * Sigma));
+		}
+
+		std::vector<uint8_t> points(Count, 0);
+		std::vector<float> energy(Count, 0.0f);
+		auto update = [&](int p, float sign) {
+			int px = p % Size, py = p / Size;
+			for (int dy = -Radius; dy <= Radius; dy++)
+			{
+				for (int dx = -Radius; dx <= Radius; dx++)
+					energy[((py + dy) & (Size - 1)) * Size + ((px + dx) & (Size - 1))] += sign * kernel[dy + Radius][dx + Radius];
+			}
+		};
+		auto tightestCluster = [&]() {
+			int best = -1;
+			for (int i = 0; i < Count; i++)
+				if (points[i] && (best < 0 || energy[i] > energy[best]))
+					best = i;
+			return best;
+		};
+		auto largestVoid = [&]() {
+			int best = -1;
+			for (int i = 0; i < Count; i++)
+				if (!points[i] && (best < 0 || energy[i] < energy[best]))
+					best = i;
+			return best;
+		};
+
+		// Random initial points, moved from the tightest cluster to the largest void until even.
+		Random random(0);
+		int initialCount = Count / 10;
+		for (int placed = 0; placed < initialCount;)
+		{
+			int p = random.Int(0, Count - 1);
+			if (!points[p]) {
+				points[p] = 1;
+				update(p, 1.0f);
+				placed++;
+			}
+		}
+		while (true) {
+			int cluster = tightestCluster();
+			points[cluster] = 0;
+			update(cluster, -1.0f);
+			int largest = largestVoid();
+			points[largest] = 1;
+			update(largest, 1.0f);
+			if (largest == cluster)
+				break;
+		}
+
+		std::vector<int> ranks(Count);
+		std::vector<uint8_t> initialPoints = points;
+		std::vector<float> initialEnergy = energy;
+		for (int rank = initialCount - 1; rank >= 0; rank--)
+		{
+			int cluster = tightestCluster();
+			points[cluster] = 0;
+			update(cluster, -1.0f);
+			ranks[cluster] = rank;
+		}
+		points = initialPoints;
+		energy = initialEnergy;
+		for (int rank = initialCount; rank < Count; rank++)
+		{
+			int largest = largestVoid();
+			points[largest] = 1;
+			update(largest, 1.0f);
+			ranks[largest] = rank;
+		}
+
+		std::vector<float> values(Count);
+		for (int i = 0; i < Count; i++)
+			values[i] = ((float)ranks[i] + 0.5f) / (float)Count;
+		return values;
+	}();
+	return tile;
+}
+
+Sampler::Sampler(SamplerType type, uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed, uint32_t dimension)
+	: m_Type(type), m_X(x), m_Y(y), m_SampleIndex(sampleIndex), m_Seed(seed), m_Dimension(dimension) {
+	m_PixelSeed = Random::Hash(Random::Hash(Random::Hash(seed) + y) + x);
+}
+
+glm::vec2 Sampler::Get(uint32_t dimensionCount) {
+	glm::vec2 u;
+	switch (m_Type) {
+	case SamplerType::Stratified:
+		u = GetStratified(dimensionCount);
+		break;
+	case SamplerType::Sobol:
+		// Scrambled per pixel and dimension pair, the samples of a pixel are a (0,2) sequence.
+		u = GetSobol(m_SampleIndex, Random::Hash(m_PixelSeed + m_Dimension), dimensionCount);
+		break;
+	case SamplerType::BlueNoise:
+		u = GetBlueNoise(dimensionCount);
+		break;
+	default: {
+		Random random(Random::Hash(m_PixelSeed + m_SampleIndex) + m_Dimension);
+		u.x = random.Float();
+		u.y = dimensionCount > 1 ? random.Float() : 0.0f;
+		break;
+	}
+	}
+	m_Dimension += 2;
+	return u;
+}
+
+glm::vec2 Sampler::GetStratified(uint32_t dimensionCount) const {
+	constexpr uint32_t StrataCount = 16;
+	constexpr uint32_t StrataPerAxis = 4;
+	// Each run of 16 samples visits the strata in its own shuffled order, 4x4 of them in 2D.
+	uint32_t seed = Random::Hash(Random::Hash(m_PixelSeed + m_Dimension) + m_SampleIndex / StrataCount);
+	uint32_t stratum = ReverseBits(LaineKarrasPermutation(ReverseBits((m_SampleIndex % StrataCount) << 28), seed)) >> 28;
+	Random random(seed + m_SampleIndex % StrataCount);
+	float jitterX = random.Float();
+	if (dimensionCount == 1)
+		return glm::vec2(((float)stratum + jitterX) / StrataCount, 0.0f);
+	float jitterY = random.Float();
+	return glm::vec2(((float)(stratum % StrataPerAxis) + jitterX) / StrataPerAxis, ((float)(stratum / StrataPerAxis) + jitterY) / StrataPerAxis);
+}
+
+glm::vec2 Sampler::GetSobol(uint32_t index, uint32_t seed, uint32_t dimensionCount) const {
+	// The first dimension of Sobol reverses the bits of the index. The index is shuffled too, so
+	// dimension pairs of the same sample are not correlated.
+	Random random(seed);
+	uint32_t reversedIndex = LaineKarrasPermutation(ReverseBits(index), random.UInt());
+	uint32_t shuffledIndex = ReverseBits(reversedIndex);
+	uint32_t x = ReverseBits(LaineKarrasPermutation(shuffledIndex, random.UInt()));
+	if (dimensionCount == 1)
+		return glm::vec2(ToFloat(x), 0.0f);
+	uint32_t y = ReverseBits(LaineKarrasPermutation(SobolReversed(shuffledIndex), random.UInt()));
+	return glm::vec2(ToFloat(x), ToFloat(y));
+}
+
+glm::vec2 Sampler::GetBlueNoise(uint32_t dimensionCount) const {
+	// Every pixel walks the same sequence, shifted by its blue noise value. Neighbouring pixels
+	// then have different errors, which the eye sees as fine grain instead of clumps.
+	uint32_t seed = Random::Hash(m_Seed + m_Dimension);
+	glm::vec2 u = GetSobol(m_SampleIndex, seed, dimensionCount);
+	const std::vector<float>& tile = GetBlueNoiseTile();
+	uint32_t offset = Random::Hash(seed);
+	float shiftX = tile[((m_Y + (offset >> 0)) & 63) * 64 + ((m_X + (offset >> 6)) & 63)];
+	float shiftY = dimensionCount > 1 ? tile[((m_Y + (offset >> 12)) & 63) * 64 + ((m_X + (offset >> 18)) & 63)] : 0.0f;
+	return glm::fract(u + glm::vec2(shiftX, shiftY));
+}
+
+glm::vec3 SampleUnitSphere(const glm::vec2& u) {
+	float z = 1.0f - 2.0f * u.x;
+	float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+	float phi = 2.0f * glm::pi<float>() * u.y;
+	return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
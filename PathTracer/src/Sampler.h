@@ -0,0 +1,42 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+
+enum class SamplerType {
+	Random,     // Independent PCG numbers
+	Stratified, // Jittered 4x4 strata, every 16 samples cover each stratum of a pixel once
+	Sobol,      // Owen scrambled Sobol (0,2) sequence, padded per dimension pair
+	BlueNoise   // One Sobol sequence for the image, shifted per pixel by a blue noise tile
+};
+
+// Sample values of one path, a function of the pixel, its sample index and the dimension, so
+// they do not depend on the thread or the order they are drawn in. Every call takes the next
+// pair of dimensions, a path that starts at a later bounce starts at a later dimension.
+class Sampler {
+public:
+	Sampler(SamplerType type, uint32_t x, uint32_t y, uint32_t sampleIndex, uint32_t seed, uint32_t dimension);
+
+	glm::vec2 Get2D() { return Get(2); }
+	float Get1D() { return Get(1).x; }
+
+	// Every bounce takes this many dimensions, bounce k of a path starts at k * DimensionsPerBounce.
+	static constexpr uint32_t DimensionsPerBounce = 6;
+private:
+	// A 1D sample still takes a pair of dimensions but skips computing the second.
+	glm::vec2 Get(uint32_t dimensionCount);
+	glm::vec2 GetStratified(uint32_t dimensionCount) const;
+	glm::vec2 GetSobol(uint32_t index, uint32_t seed, uint32_t dimensionCount) const;
+	glm::vec2 GetBlueNoise(uint32_t dimensionCount) const;
+private:
+	SamplerType m_Type;
+	uint32_t m_X, m_Y;
+	uint32_t m_SampleIndex;
+	uint32_t m_Seed;
+	uint32_t m_PixelSeed;
+	uint32_t m_Dimension;
+};
+
+// Uniformly distributed direction from a sample of the unit square.
+glm::vec3 SampleUnitSphere(const glm::vec2& u);
@@ -2,14 +2,42 @@
 
 #include "Model.h"
 #include "Texture.h"
+#include "TLAS.h"
 
 #include <vector>
 
 struct Scene {
 
 	std::vector<Model> Models;
+	std::vector<MeshInstance> Instances;
+	TLAS TopLevel;
 	std::vector<Texture> EnvironmentImages;
 	float EnvironmetStrength = 1.0f;
 	uint32_t SelectedEnvironment = 0;
 	float EnvironmentRotation = 0;
-};
\ No newline at end of file
+
+	// Places every mesh of the model with the given transform.
+	void AddModelInstance(uint32_t modelIndex, const glm::mat4& transform = glm::mat4(1.0f)) {
+		for (uint32_t i = 0; i < Models[modelIndex].GetMeshes().size(); i++)
+		{
+			MeshInstance instance;
+			instance.ModelIndex = modelIndex;
+			instance.MeshIndex = i;
+			instance.SetTransform(transform);
+			Instances.push_back(instance);
+		}
+	}
+
+	// Has to be called after instances are added or moved.
+	void BuildTLAS() { TopLevel.Build(Models, Instances); }
+
+	bool Intersect(const Ray& ray, TLASHit& hit, BVHLayout layout = BVHLayout::Binary) const { return TopLevel.Intersect(ray, Models, Instances, hit, layout); }
+	// Cheaper than Intersect when only visibility matters, e.g. for shadow rays.
+	bool Occluded(const Ray& ray, float tMax, BVHLayout layout = BVHLayout::Binary) const { return TopLevel.Occluded(ray, Models, Instances, tMax, layout); }
+
+	// Closest hits of a coherent ray packet, e.g. the primary rays of a screen tile.
+	template<uint32_t Width>
+	uint32_t IntersectPacket(const RayPacket<Width>& packet, TLASHit* hits, BVHLayout layout = BVHLayout::Binary) const {
+		return TopLevel.IntersectPacket(packet, Models, Instances, hits, layout);
+	}
+};
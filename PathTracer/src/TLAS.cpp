@@ -0,0 +1,153 @@
+#include "TLAS.h"
+#include "BVHTraversal.h"
+#include "Utils.h"
+
+#include <spdlog/spdlog.h>
+
+void MeshInstance::SetTransform(const glm::mat4& transform) {
+	Transform = transform;
+	InverseTransform = glm::inverse(transform);
+	NormalMatrix = glm::transpose(glm::mat3(InverseTransform));
+}
+
+void MeshInstance::UpdateBounds(const AABB& meshBounds) {
+	Bounds = AABB();
+	if (meshBounds.IsEmpty())
+		return;
+	for (uint32_t i = 0; i < 8; i++)
+	{
+		glm::vec3 corner(
+			(i & 1) ? meshBounds.Max.x : meshBounds.Min.x,
+			(i & 2) ? meshBounds.Max.y : meshBounds.Min.y,
+			(i & 4) ? meshBounds.Max.z : meshBounds.Min.z);
+		Bounds.Grow(glm::vec3(Transform * glm::vec4(corner, 1.0f)));
+	}
+}
+
+void TLAS::Build(const std::vector<Model>& models, std::vector<MeshInstance>& instances) {
+	Timer timer;
+
+	std::vector<BVHPrimitive> primitives(instances.size());
+	for (uint32_t i = 0; i < instances.size(); i++)
+	{
+		MeshInstance& instance = instances[i];
+		instance.UpdateBounds(models[instance.ModelIndex].GetMeshes()[instance.MeshIndex].GetAABB());
+		primitives[i].Bounds = instance.Bounds;
+		primitives[i].Centroid = instance.Bounds.GetCenter();
+	}
+
+	// Testing an instance means descending into a whole mesh BVH, so keep one per leaf.
+	BVHBuildSettings settings;
+	settings.MaxTrianglesInLeaf = 1;
+	BVHBuilder builder(settings);
+	builder.Build(primitives, m_Nodes, m_InstanceOrder);
+
+	spdlog::info("TLAS: {} instances, {} nodes, built in {:.2f} ms", instances.size(), m_Nodes.size(), timer.ElapsedMillis());
+}
+
+bool TLAS::Intersect(const Ray& ray, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, TLASHit& hit, BVHLayout layout) const {
+	bool found = false;
+	TraverseBVH(m_Nodes, ray, hit.Distance,
+		[&](const BVHNode& leaf) {
+			for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.TriangleCount; i++)
+			{
+				uint32_t instanceIndex = m_InstanceOrder[i];
+				const MeshInstance& instance = instances[instanceIndex];
+				const Mesh& mesh = models[instance.ModelIndex].GetMeshes()[instance.MeshIndex];
+				uint32_t triangleIndex;
+				glm::vec2 barycentrics;
+				if (mesh.Intersect(instance.ToObjectSpace(ray), layout, hit.Distance, triangleIndex, barycentrics)) {
+					hit.InstanceIndex = instanceIndex;
+					hit.TriangleIndex = triangleIndex;
+					hit.Barycentrics = barycentrics;
+					found = true;
+				}
+			}
+			return false;
+		});
+	return found;
+}
+
+bool TLAS::Occluded(const Ray& ray, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, float tMax, BVHLayout layout) const {
+	bool occluded = false;
+	TraverseBVH(m_Nodes, ray, tMax,
+		[&](const BVHNode& leaf) {
+			for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.TriangleCount; i++)
+			{
+				const MeshInstance& instance = instances[m_InstanceOrder[i]];
+				const Mesh& mesh = models[instance.ModelIndex].GetMeshes()[instance.MeshIndex];
+				if (mesh.Occluded(instance.ToObjectSpace(ray), layout, tMax)) {
+					occluded = true;
+					return true;
+				}
+			}
+			return false;
+		});
+	return occluded;
+}
+
+template<uint32_t Width>
+uint32_t TLAS::IntersectPacket(const RayPacket<Width>& packet, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, TLASHit* hits, BVHLayout layout) const {
+	float hitDistance[Width];
+	for (uint32_t lane = 0; lane < Width; lane++)
+		hitDistance[lane] = hits[lane].Distance;
+
+	uint32_t hitMask = 0;
+	TraverseBVHPacket(m_Nodes, packet.Rays[std::countr_zero(packet.ActiveMask)], packet.ActiveMask,
+		[&](const BVHNode& node, uint32_t mask) {
+			return IntersectBox(node.BoundingBox, packet, hitDistance, mask);
+		},
+		[&](const BVHNode& leaf, uint32_t mask) {
+			for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.TriangleCount; i++)
+			{
+				uint32_t instanceIndex = m_InstanceOrder[i];
+				const MeshInstance& instance = instances[instanceIndex];
+				RayPacket<Width> localPacket;
+				for (uint32_t lanes = mask; lanes; lanes &= lanes - 1)
+				{
+					uint32_t lane = (uint32_t)std::countr_zero(lanes);
+					localPacket.Set(lane, instance.ToObjectSpace(packet.Rays[lane]));
+				}
+
+				uint32_t triangleIndex[Width];
+				glm::vec2 barycentrics[Width];
+				const Mesh& mesh = models[instance.ModelIndex].GetMeshes()[instance.MeshIndex];
+				uint32_t meshHits = mesh.IntersectPacket(localPacket, hitDistance, triangleIndex, barycentrics);
+				for (; meshHits; meshHits &= meshHits - 1)
+				{
+					uint32_t lane = (uint32_t)std::countr_zero(meshHits);
+					hits[lane].Distance = hitDistance[lane];
+					hits[lane].InstanceIndex = instanceIndex;
+					hits[lane].TriangleIndex = triangleIndex[lane];
+					hits[lane].Barycentrics = barycentrics[lane];
+					hitMask |= 1u << lane;
+				}
+			}
+		},
+		[&](uint32_t lane, uint32_t nodeIndex) {
+			const Ray& ray = packet.Rays[lane];
+			TraverseBVH(m_Nodes, ray, hitDistance[lane],
+				[&](const BVHNode& leaf) {
+					for (uint32_t i = leaf.LeftFirst; i < leaf.LeftFirst + leaf.TriangleCount; i++)
+					{
+						uint32_t instanceIndex = m_InstanceOrder[i];
+						const MeshInstance& instance = instances[instanceIndex];
+						const Mesh& mesh = models[instance.ModelIndex].GetMeshes()[instance.MeshIndex];
+						uint32_t triangleIndex;
+						glm::vec2 barycentrics;
+						if (mesh.Intersect(instance.ToObjectSpace(ray), layout, hitDistance[lane], triangleIndex, barycentrics)) {
+							hits[lane].Distance = hitDistance[lane];
+							hits[lane].InstanceIndex = instanceIndex;
+							hits[lane].TriangleIndex = triangleIndex;
+							hits[lane].Barycentrics = barycentrics;
+							hitMask |= 1u << lane;
+						}
+					}
+					return false;
+				}, nodeIndex);
+		});
+	return hitMask;
+}
+
+template uint32_t TLAS::IntersectPacket<4>(const RayPacket<4>&, const std::vector<Model>&, const std::vector<MeshInstance>&, TLASHit*, BVHLayout) const;
+template uint32_t TLAS::IntersectPacket<8>(const RayPacket<8>&, const std::vector<Model>&, const std::vector<MeshInstance>&, TLASHit*, BVHLayout) const;
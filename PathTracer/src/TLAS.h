@@ -0,0 +1,58 @@
+#pragma once
+
+#include "BVHBuilder.h"
+#include "WideBVH.h"
+#include "Model.h"
+#include "Ray.h"
+
+#include <glm/glm.hpp>
+
+#include <vector>
+
+// Places one mesh of a model in the world. Instances only reference the geometry,
+// so the same mesh can be placed any number of times without being copied.
+struct MeshInstance {
+	uint32_t ModelIndex = 0;
+	uint32_t MeshIndex = 0;
+	glm::mat4 Transform = glm::mat4(1.0f);
+	glm::mat4 InverseTransform = glm::mat4(1.0f);
+	glm::mat3 NormalMatrix = glm::mat3(1.0f);
+	AABB Bounds; // World space
+
+	void SetTransform(const glm::mat4& transform);
+	void UpdateBounds(const AABB& meshBounds);
+
+	Ray ToObjectSpace(const Ray& ray) const {
+		// The direction is not normalized, so hit distances along the local ray match the world ray.
+		return Ray(glm::vec3(InverseTransform * glm::vec4(ray.Origin, 1.0f)), glm::mat3(InverseTransform) * ray.Direction);
+	}
+};
+
+struct TLASHit {
+	float Distance = std::numeric_limits<float>::max();
+	uint32_t InstanceIndex = 0;
+	uint32_t TriangleIndex = 0;
+	glm::vec2 Barycentrics = glm::vec2(0.0f); // Weights of the second and third corner
+};
+
+// Top level acceleration structure: a BVH over the world space bounds of the mesh
+// instances. Each mesh's own BVH is used as the bottom level.
+class TLAS {
+public:
+	TLAS() = default;
+
+	void Build(const std::vector<Model>& models, std::vector<MeshInstance>& instances);
+
+	bool Intersect(const Ray& ray, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, TLASHit& hit, BVHLayout layout = BVHLayout::Binary) const;
+	// Shadow ray query: stops at the first instance hit closer than tMax and skips the hit data.
+	bool Occluded(const Ray& ray, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, float tMax, BVHLayout layout = BVHLayout::Binary) const;
+	// Closest hits of a ray packet, hits holds one entry per lane. Rays that leave the packet
+	// are traced on their own with the given layout. Returns the lanes that hit something.
+	template<uint32_t Width>
+	uint32_t IntersectPacket(const RayPacket<Width>& packet, const std::vector<Model>& models, const std::vector<MeshInstance>& instances, TLASHit* hits, BVHLayout layout = BVHLayout::Binary) const;
+
+	const BVHNodeArray& GetNodes() const { return m_Nodes; }
+private:
+	BVHNodeArray m_Nodes;
+	std::vector<uint32_t> m_InstanceOrder;
+};
@@ -2,6 +2,9 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <cmath>
+
 Texture::Texture(const char* path) {
 	m_ImageData = stbi_load(path, &m_Width, &m_Height, &m_Channels, 0);
 	if (m_ImageData == nullptr) {
@@ -26,8 +29,9 @@ Texture::Texture(const char* path) {
 }
 
 const glm::vec3 Texture::SampleTexture(const glm::vec2& texCoord) const {
-	int x = static_cast<int>(texCoord.x * m_Width);
-	int y = static_cast<int>(texCoord.y * m_Height);
+	// Coordinates of exactly 1 (or slightly past it) would read past the last row.
+	int x = std::clamp(static_cast<int>(texCoord.x * m_Width), 0, m_Width - 1);
+	int y = std::clamp(static_cast<int>(texCoord.y * m_Height), 0, m_Height - 1);
 	uint32_t pixelIndex = (x + m_Width * y) * m_Channels;
 	unsigned char red = m_ImageData[pixelIndex];
 	unsigned char green = m_ImageData[pixelIndex+1];
@@ -42,6 +46,7 @@ const glm::vec3 Texture::SampleSphericalTexture(const float& phi, const float& t
 #define PI 3.1415926536
 	// Map spherical coordinates to image coordinates
 	float u = (phi + PI) / (2 * PI);
+	u -= std::floor(u); // The environment rotation can push phi past a full turn
 	float v = (theta / PI);
 
 	return SampleTexture(glm::vec2(u, v));
@@ -0,0 +1,223 @@
+#include "TileScheduler.h"
+#include "Morton.h"
+#include "Utils.h"
+
+#include <algorithm>
+
+TileScheduler::TileScheduler(uint32_t threadCount) {
+	if (threadCount == 0)
+		threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	m_ThreadStats.resize(threadCount);
+	for (uint32_t i = 0; i < threadCount; i++)
+		m_Queues.push_back(std::make_unique<Queue>());
+	// Worker 0 is whoever calls Run.
+	for (uint32_t i = 1; i < threadCount; i++)
+		m_Threads.emplace_back(&TileScheduler::WorkerLoop, this, i);
+}
+
+TileScheduler::~TileScheduler() {
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Stop = true;
+	}
+	m_Start.notify_all();
+	for (std::thread& thread : m_Threads)
+		thread.join();
+}
+
+void TileScheduler::Run(uint32_t width, uint32_t height, const std::function<void(const Tile&)>& processTile) {
+	uint32_t tilesX = (width + TileSize - 1) / TileSize;
+	uint32_t tilesY = (height + TileSize - 1) / TileSize;
+	if (tilesX == 0 || tilesY == 0)
+		return;
+
+	m_Tiles.clear();
+	for (uint32_t y = 0; y < tilesY; y++)
+	{
+		for (uint32_t x = 0; x < tilesX; x++)
+			m_Tiles.push_back({ x * TileSize, y * TileSize, std::min(TileSize, width - x * TileSize), std::min(TileSize, height - y * TileSize) });
+	}
+	std::sort(m_Tiles.begin(), m_Tiles.end(), [](const Tile& a, const Tile& b) {
+		return MortonCode(glm::uvec2(a.X, a.Y) / TileSize) < MortonCode(glm::uvec2(b.X, b.Y) / TileSize);
+	});
+
+	uint32_t threadCount = GetThreadCount();
+	uint32_t idleWorkers = 0;
+	for (uint32_t i = 0; i < threadCount; i++)
+	{
+		size_t first = m_Tiles.size() * i / threadCount;
+		size_t last = m_Tiles.size() * (i + 1) / threadCount;
+		m_Queues[i]->Tiles.assign(m_Tiles.begin() + first, m_Tiles.begin() + last);
+		m_Queues[i]->StartsIdle = first == last;
+		idleWorkers += first == last;
+	}
+
+	m_ProcessTile = &processTile;
+	m_PendingTiles = (uint32_t)m_Tiles.size();
+	m_PendingPixels = width * height;
+	m_FinishedPixels = 0;
+	m_FinishedTime = 0;
+	m_IdleWorkers = idleWorkers;
+	m_RunSplitCount = 0;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_ActiveWorkers = (uint32_t)m_Threads.size();
+		m_Generation++;
+	}
+	m_Start.notify_all();
+
+	ProcessTiles(0);
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	m_Done.wait(lock, [this]() { return m_ActiveWorkers == 0; });
+	m_ProcessTile = nullptr;
+	m_SplitCount += m_RunSplitCount;
+}
+
+void TileScheduler::RunRange(uint32_t count, const std::function<void(uint32_t first, uint32_t last)>& processRange) {
+	uint32_t batchCount = (count + RangeBatchSize - 1) / RangeBatchSize;
+	Run(batchCount, 1, [&](const Tile& tile) {
+		processRange(tile.X * RangeBatchSize, std::min(count, (tile.X + tile.Width) * RangeBatchSize));
+	});
+}
+
+void TileScheduler::ResetStats() {
+	std::fill(m_ThreadStats.begin(), m_ThreadStats.end(), ThreadStats());
+	m_SplitCount = 0;
+}
+
+void TileScheduler::WorkerLoop(uint32_t index) {
+	uint64_t generation = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_Mutex);
+			m_Start.wait(lock, [&]() { return m_Stop || m_Generation != generation; });
+			if (m_Stop)
+				return;
+			generation = m_Generation;
+		}
+
+		ProcessTiles(index);
+
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (--m_ActiveWorkers == 0)
+			m_Done.notify_one();
+	}
+}
+
+void TileScheduler::ProcessTiles(uint32_t index) {
+	ThreadStats& stats = m_ThreadStats[index];
+	bool idle = m_Queues[index]->StartsIdle;
+	while (m_PendingTiles > 0) {
+		// Read before looking for a tile, so a tile pushed after the search fails still wakes us.
+		uint32_t signal = m_WorkSignal;
+		Tile tile;
+		bool stolen;
+		if (!PopTile(index, tile, stolen)) {
+			if (!idle) {
+				idle = true;
+				m_IdleWorkers++;
+			}
+			if (m_PendingTiles > 0)
+				m_WorkSignal.wait(signal);
+			continue;
+		}
+		if (idle) {
+			idle = false;
+			m_IdleWorkers--;
+		}
+
+		// Hand halves to the idle workers, one each, they steal from the back of the queue.
+		Tile secondHalf;
+		for (uint32_t handedOut = 0; handedOut < m_IdleWorkers && IsWorthSplitting(tile) && SplitTile(tile, secondHalf); handedOut++)
+		{
+			m_PendingTiles++;
+			m_RunSplitCount++;
+			{
+				std::lock_guard<std::mutex> lock(m_Queues[index]->Mutex);
+				m_Queues[index]->Tiles.push_back(secondHalf);
+			}
+			SignalWork(false);
+		}
+
+		Timer timer;
+		(*m_ProcessTile)(tile);
+		float time = timer.ElapsedMillis();
+		stats.BusyTime += time;
+		stats.TileCount++;
+		stats.StolenCount += stolen;
+		m_FinishedPixels += tile.Width * tile.Height;
+		m_FinishedTime += (uint64_t)(time * 1e6f);
+		m_PendingPixels -= tile.Width * tile.Height;
+		if (--m_PendingTiles == 0)
+			SignalWork(true);
+	}
+	if (idle)
+		m_IdleWorkers--;
+}
+
+void TileScheduler::SignalWork(bool all) {
+	m_WorkSignal++;
+	if (all)
+		m_WorkSignal.notify_all();
+	else
+		m_WorkSignal.notify_one();
+}
+
+bool TileScheduler::IsWorthSplitting(const Tile& tile) const {
+	uint32_t pixels = tile.Width * tile.Height;
+	uint64_t finishedPixels = m_FinishedPixels;
+	if (finishedPixels > 0) {
+		// The finished tiles tell how long a pixel takes in this run.
+		double timePerPixel = (double)m_FinishedTime / (double)finishedPixels * 1e-6;
+		return 0.5 * pixels * timePerPixel >= MinSplitTime;
+	}
+	// Nothing measured yet, split while the tile is more than a worker's share of the work left.
+	return (uint64_t)pixels * GetThreadCount() > m_PendingPixels;
+}
+
+bool TileScheduler::PopTile(uint32_t index, Tile& outTile, bool& outStolen) {
+	{
+		Queue& queue = *m_Queues[index];
+		std::lock_guard<std::mutex> lock(queue.Mutex);
+		if (!queue.Tiles.empty()) {
+			outTile = queue.Tiles.front();
+			queue.Tiles.pop_front();
+			outStolen = false;
+			return true;
+		}
+	}
+
+	// Stealing from the back takes the tiles farthest from where the owner is working.
+	uint32_t threadCount = GetThreadCount();
+	for (uint32_t i = 1; i < threadCount; i++)
+	{
+		Queue& queue = *m_Queues[(index + i) % threadCount];
+		std::lock_guard<std::mutex> lock(queue.Mutex);
+		if (!queue.Tiles.empty()) {
+			outTile = queue.Tiles.back();
+			queue.Tiles.pop_back();
+			outStolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool TileScheduler::SplitTile(Tile& tile, Tile& outSecondHalf) const {
+	// Rows first, a column split is only possible on MinTileWidth boundaries.
+	if (tile.Height >= 2 * MinTileHeight) {
+		uint32_t half = tile.Height / 2 / MinTileHeight * MinTileHeight;
+		outSecondHalf = { tile.X, tile.Y + half, tile.Width, tile.Height - half };
+		tile.Height = half;
+		return true;
+	}
+	if (tile.Width >= 2 * MinTileWidth) {
+		uint32_t half = tile.Width / 2 / MinTileWidth * MinTileWidth;
+		outSecondHalf = { tile.X + half, tile.Y, tile.Width - half, tile.Height };
+		tile.Width = half;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Rectangle of pixels, X and Y are its top left corner.
+struct Tile {
+	uint32_t X = 0;
+	uint32_t Y = 0;
+	uint32_t Width = 0;
+	uint32_t Height = 0;
+};
+
+// Persistent worker threads that process an image tile by tile. The tiles are handed out in
+// Morton order, every worker starts on its own contiguous run of them and steals from the end
+// of the other runs once its own is done. Workers without anything left to steal sleep until
+// a busy worker splits its next tile for them, which it does when the tile is expected to take
+// long enough to be worth sharing, so one expensive tile can not hold up the frame.
+class TileScheduler {
+public:
+	// 16 pixels of RGB floats are three cache lines, so tiles only share lines at their edges
+	// and none at all when the image width is a multiple of 16.
+	static constexpr uint32_t TileSize = 32;
+	static constexpr uint32_t MinTileWidth = 16;
+	static constexpr uint32_t MinTileHeight = 2;
+	// Items per column of a RunRange "image", a tile covers TileSize batches.
+	static constexpr uint32_t RangeBatchSize = 64;
+	// A tile is only split when the half handed to an idle worker is expected to take at least
+	// this long, below it waking the worker and the extra tile cost more than they save.
+	static constexpr float MinSplitTime = 0.05f; // ms
+
+	struct ThreadStats {
+		float BusyTime = 0.0f; // ms spent inside the tile callback
+		uint32_t TileCount = 0;
+		uint32_t StolenCount = 0;
+	};
+public:
+	// threadCount includes the calling thread, 0 uses one per hardware thread.
+	TileScheduler(uint32_t threadCount = 0);
+	~TileScheduler();
+
+	TileScheduler(const TileScheduler&) = delete;
+	TileScheduler& operator=(const TileScheduler&) = delete;
+
+	// Calls processTile for tiles covering a width x height image and returns once all are done.
+	// The calling thread works as well. Tiles start at multiples of MinTileWidth / MinTileHeight.
+	void Run(uint32_t width, uint32_t height, const std::function<void(const Tile&)>& processTile);
+	// Same for a one dimensional range, processRange gets consecutive [first, last) pieces of [0, count).
+	void RunRange(uint32_t count, const std::function<void(uint32_t first, uint32_t last)>& processRange);
+
+	// Statistics summed over the Run calls since the last reset.
+	void ResetStats();
+	const std::vector<ThreadStats>& GetThreadStats() const { return m_ThreadStats; }
+	uint32_t GetSplitCount() const { return m_SplitCount; }
+	uint32_t GetThreadCount() const { return (uint32_t)m_Queues.size(); }
+private:
+	struct alignas(64) Queue {
+		std::mutex Mutex;
+		std::deque<Tile> Tiles;
+		// Run gave the worker no tiles, it counts as idle from the start so the first tiles
+		// popped are already split for it.
+		bool StartsIdle = false;
+	};
+
+	void WorkerLoop(uint32_t index);
+	void ProcessTiles(uint32_t index);
+	bool PopTile(uint32_t index, Tile& outTile, bool& outStolen);
+	bool SplitTile(Tile& tile, Tile& outSecondHalf) const;
+	bool IsWorthSplitting(const Tile& tile) const;
+	// Wakes the workers waiting for a tile to steal or for the run to end.
+	void SignalWork(bool all);
+private:
+	std::vector<std::unique_ptr<Queue>> m_Queues;
+	std::vector<std::thread> m_Threads;
+	std::vector<ThreadStats> m_ThreadStats;
+	std::vector<Tile> m_Tiles; // Morton ordered, reused between runs
+
+	const std::function<void(const Tile&)>* m_ProcessTile = nullptr;
+	std::atomic<uint32_t> m_PendingTiles = 0;
+	std::atomic<uint32_t> m_IdleWorkers = 0;
+	// Counts every new tile and the end of the run, idle workers wait for it to change.
+	std::atomic<uint32_t> m_WorkSignal = 0;
+	// Pixels of the tiles not yet finished, and the time taken by the finished ones.
+	std::atomic<uint32_t> m_PendingPixels = 0;
+	std::atomic<uint64_t> m_FinishedPixels = 0;
+	std::atomic<uint64_t> m_FinishedTime = 0; // ns
+	uint32_t m_SplitCount = 0;
+	std::atomic<uint32_t> m_RunSplitCount = 0;
+
+	std::mutex m_Mutex;
+	std::condition_variable m_Start;
+	std::condition_variable m_Done;
+	uint64_t m_Generation = 0;
+	uint32_t m_ActiveWorkers = 0;
+	bool m_Stop = false;
+};
@@ -0,0 +1,202 @@
+#include "Triangle.h"
+#include "SIMD.h"
+
+#include <algorithm>
+#include <bit>
+
+void TriangleBuffer::Resize(size_t count) {
+	// Lanes past the last triangle stay zero, a degenerate triangle that is never hit.
+	m_Groups.assign((count + TriangleGroupSize - 1) / TriangleGroupSize, TriangleGroup());
+	m_Groups.shrink_to_fit();
+	m_Size = count;
+}
+
+void TriangleBuffer::Set(uint32_t index, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+	TriangleGroup& group = m_Groups[index / TriangleGroupSize];
+	const uint32_t lane = index % TriangleGroupSize;
+	glm::vec3 edge1 = b - a;
+	glm::vec3 edge2 = c - a;
+	group.V0X[lane] = a.x;
+	group.V0Y[lane] = a.y;
+	group.V0Z[lane] = a.z;
+	group.Edge1X[lane] = edge1.x;
+	group.Edge1Y[lane] = edge1.y;
+	group.Edge1Z[lane] = edge1.z;
+	group.Edge2X[lane] = edge2.x;
+	group.Edge2Y[lane] = edge2.y;
+	group.Edge2Z[lane] = edge2.z;
+}
+
+TriangleKernel TriangleBuffer::GetBestKernel() {
+	return SIMD::SupportsAVX2() ? TriangleKernel::AVX2 : TriangleKernel::SSE;
+}
+
+// Lanes of the groups starting at groupFirst that belong to the range [first, end).
+static inline uint32_t RangeMask(uint32_t groupFirst, uint32_t first, uint32_t end, uint32_t laneCount) {
+	uint32_t low = first > groupFirst ? first - groupFirst : 0;
+	uint32_t high = std::min(end - groupFirst, laneCount);
+	return ((1u << high) - 1) & ~((1u << low) - 1);
+}
+
+// Moller-Trumbore test of the four triangles of a group, with the operations in the same order
+// as TriangleBuffer::Intersect so both report the same hits. Writes the distances and
+// barycentrics of all lanes and returns a bit mask of the lanes hit in front of tMax.
+static inline uint32_t IntersectGroup(const TriangleGroup& group, const Ray& ray, float tMax, float* outT, float* outU, float* outV) {
+	const __m128 epsilon = _mm_set1_ps(0.000001f);
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 directionX = _mm_set1_ps(ray.Direction.x);
+	const __m128 directionY = _mm_set1_ps(ray.Direction.y);
+	const __m128 directionZ = _mm_set1_ps(ray.Direction.z);
+	const __m128 edge1X = _mm_load_ps(group.Edge1X);
+	const __m128 edge1Y = _mm_load_ps(group.Edge1Y);
+	const __m128 edge1Z = _mm_load_ps(group.Edge1Z);
+	const __m128 edge2X = _mm_load_ps(group.Edge2X);
+	const __m128 edge2Y = _mm_load_ps(group.Edge2Y);
+	const __m128 edge2Z = _mm_load_ps(group.Edge2Z);
+
+	// h = cross(direction, edge2), a = dot(edge1, h)
+	__m128 hX = _mm_sub_ps(_mm_mul_ps(directionY, edge2Z), _mm_mul_ps(edge2Y, directionZ));
+	__m128 hY = _mm_sub_ps(_mm_mul_ps(directionZ, edge2X), _mm_mul_ps(edge2Z, directionX));
+	__m128 hZ = _mm_sub_ps(_mm_mul_ps(directionX, edge2Y), _mm_mul_ps(edge2X, directionY));
+	__m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge1X, hX), _mm_mul_ps(edge1Y, hY)), _mm_mul_ps(edge1Z, hZ));
+	__m128 f = _mm_div_ps(one, a);
+
+	// s = origin - v0, u = f * dot(s, h)
+	__m128 sX = _mm_sub_ps(_mm_set1_ps(ray.Origin.x), _mm_load_ps(group.V0X));
+	__m128 sY = _mm_sub_ps(_mm_set1_ps(ray.Origin.y), _mm_load_ps(group.V0Y));
+	__m128 sZ = _mm_sub_ps(_mm_set1_ps(ray.Origin.z), _mm_load_ps(group.V0Z));
+	__m128 u = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sX, hX), _mm_mul_ps(sY, hY)), _mm_mul_ps(sZ, hZ)));
+
+	// q = cross(s, edge1), v = f * dot(direction, q), t = f * dot(edge2, q)
+	__m128 qX = _mm_sub_ps(_mm_mul_ps(sY, edge1Z), _mm_mul_ps(edge1Y, sZ));
+	__m128 qY = _mm_sub_ps(_mm_mul_ps(sZ, edge1X), _mm_mul_ps(edge1Z, sX));
+	__m128 qZ = _mm_sub_ps(_mm_mul_ps(sX, edge1Y), _mm_mul_ps(edge1X, sY));
+	__m128 v = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(directionX, qX), _mm_mul_ps(directionY, qY)), _mm_mul_ps(directionZ, qZ)));
+	__m128 t = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(edge2X, qX), _mm_mul_ps(edge2Y, qY)), _mm_mul_ps(edge2Z, qZ)));
+
+	// Ordered compares reject the NaNs of parallel rays like the scalar branches do.
+	__m128 hit = _mm_or_ps(_mm_cmple_ps(a, _mm_set1_ps(-0.000001f)), _mm_cmpge_ps(a, epsilon));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(t, epsilon), _mm_cmplt_ps(t, _mm_set1_ps(tMax))));
+
+	_mm_storeu_ps(outT, t);
+	_mm_storeu_ps(outU, u);
+	_mm_storeu_ps(outV, v);
+	return (uint32_t)_mm_movemask_ps(hit);
+}
+
+PT_TARGET_AVX2 static inline __m256 LoadGroupPair(const float* low, const float* high) {
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_load_ps(low)), _mm_load_ps(high), 1);
+}
+
+// Same test for two neighbouring groups, first in the low and second in the high lanes.
+PT_TARGET_AVX2 static uint32_t IntersectGroupPair(const TriangleGroup& first, const TriangleGroup& second, const Ray& ray, float tMax, float* outT, float* outU, float* outV) {
+	const __m256 epsilon = _mm256_set1_ps(0.000001f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 directionX = _mm256_set1_ps(ray.Direction.x);
+	const __m256 directionY = _mm256_set1_ps(ray.Direction.y);
+	const __m256 directionZ = _mm256_set1_ps(ray.Direction.z);
+	const __m256 edge1X = LoadGroupPair(first.Edge1X, second.Edge1X);
+	const __m256 edge1Y = LoadGroupPair(first.Edge1Y, second.Edge1Y);
+	const __m256 edge1Z = LoadGroupPair(first.Edge1Z, second.Edge1Z);
+	const __m256 edge2X = LoadGroupPair(first.Edge2X, second.Edge2X);
+	const __m256 edge2Y = LoadGroupPair(first.Edge2Y, second.Edge2Y);
+	const __m256 edge2Z = LoadGroupPair(first.Edge2Z, second.Edge2Z);
+
+	__m256 hX = _mm256_sub_ps(_mm256_mul_ps(directionY, edge2Z), _mm256_mul_ps(edge2Y, directionZ));
+	__m256 hY = _mm256_sub_ps(_mm256_mul_ps(directionZ, edge2X), _mm256_mul_ps(edge2Z, directionX));
+	__m256 hZ = _mm256_sub_ps(_mm256_mul_ps(directionX, edge2Y), _mm256_mul_ps(edge2X, directionY));
+	__m256 a = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge1X, hX), _mm256_mul_ps(edge1Y, hY)), _mm256_mul_ps(edge1Z, hZ));
+	__m256 f = _mm256_div_ps(one, a);
+
+	__m256 sX = _mm256_sub_ps(_mm256_set1_ps(ray.Origin.x), LoadGroupPair(first.V0X, second.V0X));
+	__m256 sY = _mm256_sub_ps(_mm256_set1_ps(ray.Origin.y), LoadGroupPair(first.V0Y, second.V0Y));
+	__m256 sZ = _mm256_sub_ps(_mm256_set1_ps(ray.Origin.z), LoadGroupPair(first.V0Z, second.V0Z));
+	__m256 u = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sX, hX), _mm256_mul_ps(sY, hY)), _mm256_mul_ps(sZ, hZ)));
+
+	__m256 qX = _mm256_sub_ps(_mm256_mul_ps(sY, edge1Z), _mm256_mul_ps(edge1Y, sZ));
+	__m256 qY = _mm256_sub_ps(_mm256_mul_ps(sZ, edge1X), _mm256_mul_ps(edge1Z, sX));
+	__m256 qZ = _mm256_sub_ps(_mm256_mul_ps(sX, edge1Y), _mm256_mul_ps(edge1X, sY));
+	__m256 v = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(directionX, qX), _mm256_mul_ps(directionY, qY)), _mm256_mul_ps(directionZ, qZ)));
+	__m256 t = _mm256_mul_ps(f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(edge2X, qX), _mm256_mul_ps(edge2Y, qY)), _mm256_mul_ps(edge2Z, qZ)));
+
+	__m256 hit = _mm256_or_ps(_mm256_cmp_ps(a, _mm256_set1_ps(-0.000001f), _CMP_LE_OQ), _mm256_cmp_ps(a, epsilon, _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_GE_OQ), _mm256_cmp_ps(u, one, _CMP_LE_OQ)));
+	hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_GE_OQ), _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ)));
+	hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(t, epsilon, _CMP_GT_OQ), _mm256_cmp_ps(t, _mm256_set1_ps(tMax), _CMP_LT_OQ)));
+
+	_mm256_storeu_ps(outT, t);
+	_mm256_storeu_ps(outU, u);
+	_mm256_storeu_ps(outV, v);
+	return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+bool TriangleBuffer::IntersectRange(TriangleKernel kernel, uint32_t first, uint32_t count, const Ray& ray, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+	bool hit = false;
+	const uint32_t end = first + count;
+	if (kernel == TriangleKernel::Scalar) {
+		for (uint32_t i = first; i < end; i++)
+		{
+			float t;
+			glm::vec2 uv;
+			if (Intersect(i, ray, t, uv) && t < hitDistance) {
+				hitDistance = t;
+				triangleIndex = i;
+				barycentrics = uv;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+
+	// Lanes are visited in index order and only a strictly closer hit wins, so ties go to the
+	// lower index as in the scalar loop.
+	float t[8], u[8], v[8];
+	uint32_t lastGroup = (end - 1) / TriangleGroupSize;
+	for (uint32_t group = first / TriangleGroupSize; count > 0 && group <= lastGroup;)
+	{
+		uint32_t groupFirst = group * TriangleGroupSize;
+		uint32_t laneCount = kernel == TriangleKernel::AVX2 && group < lastGroup ? 2 * TriangleGroupSize : TriangleGroupSize;
+		uint32_t mask = laneCount == TriangleGroupSize
+			? IntersectGroup(m_Groups[group], ray, hitDistance, t, u, v)
+			: IntersectGroupPair(m_Groups[group], m_Groups[group + 1], ray, hitDistance, t, u, v);
+		mask &= RangeMask(groupFirst, first, end, laneCount);
+		for (; mask; mask &= mask - 1)
+		{
+			uint32_t lane = (uint32_t)std::countr_zero(mask);
+			if (t[lane] < hitDistance) {
+				hitDistance = t[lane];
+				triangleIndex = groupFirst + lane;
+				barycentrics = glm::vec2(u[lane], v[lane]);
+				hit = true;
+			}
+		}
+		group += laneCount / TriangleGroupSize;
+	}
+	return hit;
+}
+
+bool TriangleBuffer::OccludedRange(uint32_t first, uint32_t count, const Ray& ray, float tMax) const {
+	if (count == 0)
+		return false;
+
+	const bool avx2 = GetBestKernel() == TriangleKernel::AVX2;
+	const uint32_t end = first + count;
+	float t[8], u[8], v[8];
+	uint32_t lastGroup = (end - 1) / TriangleGroupSize;
+	for (uint32_t group = first / TriangleGroupSize; group <= lastGroup;)
+	{
+		uint32_t groupFirst = group * TriangleGroupSize;
+		uint32_t laneCount = avx2 && group < lastGroup ? 2 * TriangleGroupSize : TriangleGroupSize;
+		uint32_t mask = laneCount == TriangleGroupSize
+			? IntersectGroup(m_Groups[group], ray, tMax, t, u, v)
+			: IntersectGroupPair(m_Groups[group], m_Groups[group + 1], ray, tMax, t, u, v);
+		if (mask & RangeMask(groupFirst, first, end, laneCount))
+			return true;
+		group += laneCount / TriangleGroupSize;
+	}
+	return false;
+}
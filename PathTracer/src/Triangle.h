@@ -1,59 +1,92 @@
 #pragma once
 
 #include "Vertex.h"
+#include "Ray.h"
 
-struct Triangle {
-	Vertex A;
-	Vertex B;
-	Vertex C;
-	glm::vec3 Center;
+#include <vector>
 
-	bool IntersectsWithRay(const glm::vec3& origin, const glm::vec3& direction, float& outT) const {
-		const float EPSILON = 0.000001f;
-		glm::vec3 edge1, edge2, h, s, q;
-		float a, f, u, v;
+// Four triangles in the form the intersection test reads them: the first corner and the two
+// edges leaving it, one array per component so one SSE register holds a component of all four.
+constexpr uint32_t TriangleGroupSize = 4;
+struct alignas(16) TriangleGroup {
+	float V0X[TriangleGroupSize];
+	float V0Y[TriangleGroupSize];
+	float V0Z[TriangleGroupSize];
+	float Edge1X[TriangleGroupSize];
+	float Edge1Y[TriangleGroupSize];
+	float Edge1Z[TriangleGroupSize];
+	float Edge2X[TriangleGroupSize];
+	float Edge2Y[TriangleGroupSize];
+	float Edge2Z[TriangleGroupSize];
+};
+
+enum class TriangleKernel {
+	Scalar, // One triangle at a time
+	SSE,    // One group of four per test
+	AVX2    // Two neighbouring groups per test, ranges within one group use SSE
+};
+
+// Intersection data of all triangles of a mesh, 36 bytes per triangle instead of the three
+// full vertices. Triangle i is lane i % 4 of group i / 4. The BVH pads its leaves so none
+// spans more groups than its size needs: a leaf of up to four triangles takes one SSE test,
+// one of up to eight a single AVX2 test.
+class TriangleBuffer {
+public:
+	void Resize(size_t count);
+	void Set(uint32_t index, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
 
-		edge1 = B.Position - A.Position;
-		edge2 = C.Position - A.Position;
-		h = glm::cross(direction, edge2);
-		a = glm::dot(edge1, h);
+	size_t Size() const { return m_Size; }
+	size_t GetMemoryUsage() const { return m_Groups.capacity() * sizeof(TriangleGroup); }
+
+	// Moller-Trumbore test of a single triangle. outBarycentrics are the weights of the second
+	// and third corner.
+	bool Intersect(uint32_t index, const Ray& ray, float& outT, glm::vec2& outBarycentrics) const {
+		const float EPSILON = 0.000001f;
+		const TriangleGroup& group = m_Groups[index / TriangleGroupSize];
+		const uint32_t lane = index % TriangleGroupSize;
+		const glm::vec3 v0(group.V0X[lane], group.V0Y[lane], group.V0Z[lane]);
+		const glm::vec3 edge1(group.Edge1X[lane], group.Edge1Y[lane], group.Edge1Z[lane]);
+		const glm::vec3 edge2(group.Edge2X[lane], group.Edge2Y[lane], group.Edge2Z[lane]);
 
+		glm::vec3 h = glm::cross(ray.Direction, edge2);
+		float a = glm::dot(edge1, h);
 		if (a > -EPSILON && a < EPSILON)
 			return false;
 
-		f = 1.0f / a;
-		s = origin - A.Position;
-		u = f * glm::dot(s, h);
-
+		float f = 1.0f / a;
+		glm::vec3 s = ray.Origin - v0;
+		float u = f * glm::dot(s, h);
 		if (u < 0.0f || u > 1.0f)
 			return false;
 
-		q = glm::cross(s, edge1);
-		v = f * glm::dot(direction, q);
-
+		glm::vec3 q = glm::cross(s, edge1);
+		float v = f * glm::dot(ray.Direction, q);
 		if (v < 0.0f || u + v > 1.0f)
 			return false;
 
 		outT = f * glm::dot(edge2, q);
+		outBarycentrics = glm::vec2(u, v);
+		return outT > EPSILON;
+	}
 
-		if (outT > EPSILON)
-			return true;
-
-		return false;
+	bool Intersect(uint32_t index, const Ray& ray, float& outT) const {
+		glm::vec2 barycentrics;
+		return Intersect(index, ray, outT, barycentrics);
 	}
 
-	glm::vec2 CalculateTextureCoordinates(const glm::vec3 position) const {
-		// Calculate the barycentric coordinates
-		glm::vec3 a = B.Position - C.Position;
-		glm::vec3 b = A.Position - C.Position;
-		glm::vec3 p = position - C.Position;
-		float As = glm::length(glm::cross(a, b) / 2.0f) / 2.0f;
-		float A1 = glm::length(glm::cross(b, p) / 2.0f) / 2.0f;
-		float A2 = glm::length(glm::cross(a, p) / 2.0f) / 2.0f;
-		float u = A1 / As;
-		float v = A2 / As;
-		float w = 1.0f - u - v;
-		glm::vec2 interpolatedTextureCoord = v * A.TexCoord + u * B.TexCoord + w * C.TexCoord;
-		return interpolatedTextureCoord;
+	// Closest hit among the triangles [first, first + count), with the same results as testing
+	// them one by one. hitDistance acts as tMax and is only written, together with
+	// triangleIndex and barycentrics, when a closer triangle is found.
+	bool IntersectRange(uint32_t first, uint32_t count, const Ray& ray, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+		return IntersectRange(GetBestKernel(), first, count, ray, hitDistance, triangleIndex, barycentrics);
 	}
-};
\ No newline at end of file
+	bool IntersectRange(TriangleKernel kernel, uint32_t first, uint32_t count, const Ray& ray, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const;
+	// True if any triangle of [first, first + count) is hit closer than tMax.
+	bool OccludedRange(uint32_t first, uint32_t count, const Ray& ray, float tMax) const;
+
+	// AVX2 when the CPU supports it, SSE otherwise.
+	static TriangleKernel GetBestKernel();
+private:
+	std::vector<TriangleGroup> m_Groups;
+	size_t m_Size = 0;
+};
@@ -2,32 +2,72 @@
 
 #include <glm/glm.hpp>
 
-#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 
+// PCG random numbers (RXS-M-XS variant) with a single 32 bit integer of state. A step is a
+// multiply-add and a few shifts, so every pixel, path or SIMD lane can carry its own generator.
+// Seeded from counters like pixel and sample index, the numbers do not depend on which thread
+// draws them or when.
 class Random {
 public:
-	static float Float(float min, float max) {
-		float r = min + static_cast <float> (rand()) / (static_cast <float> (RAND_MAX / (max - min)));
-		return r;
+	explicit Random(uint32_t seed) : m_State(Hash(seed)) {}
+
+	uint32_t UInt() {
+		uint32_t state = m_State;
+		m_State = state * 747796405u + 2891336453u;
+		uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return (word >> 22u) ^ word;
 	}
 
-	static glm::vec3 Vec3(float min, float max) {
-		float r2 = Float(min, max);
-		float r3 = Float(min, max);
-		float r1 = Float(min, max);
-		return glm::vec3(r1, r2, r3);
+	// [0, 1), from the top 24 bits so every value is exact in a float.
+	float Float() { return (float)(UInt() >> 8) * (1.0f / 16777216.0f); }
+
+	float Float(float min, float max) { return min + Float() * (max - min); }
+
+	glm::vec3 Vec3(float min, float max) {
+		float x = Float(min, max);
+		float y = Float(min, max);
+		float z = Float(min, max);
+		return glm::vec3(x, y, z);
 	}
 
-	static glm::vec3 InUnitSphere() {
-		return glm::normalize(Vec3(-1.0f, 1.0f));
+	// Uniform direction, a normalized point of the cube would favour its corners.
+	glm::vec3 InUnitSphere() {
+		float z = Float(-1.0f, 1.0f);
+		float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+		float phi = Float(0.0f, 6.28318531f);
+		return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
 	}
 
-	static int Int(int min, int max) {
-		std::random_device rd;
-		std::mt19937 rng(rd());
+	// [min, max], like std::uniform_int_distribution.
+	int Int(int min, int max) {
+		return min + (int)(((uint64_t)UInt() * (uint64_t)(max - min + 1)) >> 32);
+	}
 
-		std::uniform_int_distribution<int> distribution(min, max);
+	// One PCG step of v, for turning counters into seeds: Random(Hash(a) + b).
+	static uint32_t Hash(uint32_t v) {
+		uint32_t state = v * 747796405u + 2891336453u;
+		uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return (word >> 22u) ^ word;
+	}
+private:
+	uint32_t m_State;
+};
 
-		return distribution(rng);
+class Timer {
+public:
+	Timer() { Reset(); }
+
+	void Reset() { m_Start = std::chrono::high_resolution_clock::now(); }
+
+	float Elapsed() const {
+		return std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - m_Start).count();
 	}
+
+	float ElapsedMillis() const { return Elapsed() * 1000.0f; }
+private:
+	std::chrono::time_point<std::chrono::high_resolution_clock> m_Start;
 };
\ No newline at end of file
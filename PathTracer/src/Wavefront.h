@@ -0,0 +1,141 @@
+#pragma once
+
+#include "Ray.h"
+#include "TLAS.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+// Rays of the live paths as separate component arrays, so a wavefront stage streams through only
+// what it reads. The path state travels with its ray, so reordering the queue keeps it next to
+// the ray as well. The extend stage fills in the hit of every ray.
+struct RayQueue {
+	std::vector<uint32_t> PathIndex;
+	std::vector<float> OriginX, OriginY, OriginZ;
+	std::vector<float> DirectionX, DirectionY, DirectionZ;
+	std::vector<float> ThroughputR, ThroughputG, ThroughputB;
+	std::vector<float> RadianceR, RadianceG, RadianceB;
+	std::vector<float> HitDistance; // Negative on a miss
+	std::vector<float> BarycentricU, BarycentricV;
+	std::vector<uint32_t> InstanceIndex;
+	std::vector<uint32_t> TriangleIndex;
+	std::atomic<uint32_t> Size = 0;
+
+	void Resize(uint32_t capacity) {
+		for (std::vector<float>* component : GetFloatComponents())
+			component->resize(capacity);
+		PathIndex.resize(capacity);
+		InstanceIndex.resize(capacity);
+		TriangleIndex.resize(capacity);
+		Size = 0;
+	}
+
+	// Claims count consecutive slots, stages push a whole batch at once instead of one ray at a time.
+	uint32_t Allocate(uint32_t count) { return Size.fetch_add(count); }
+
+	void Set(uint32_t slot, uint32_t pathIndex, const Ray& ray, const glm::vec3& throughput, const glm::vec3& radiance) {
+		PathIndex[slot] = pathIndex;
+		OriginX[slot] = ray.Origin.x;
+		OriginY[slot] = ray.Origin.y;
+		OriginZ[slot] = ray.Origin.z;
+		DirectionX[slot] = ray.Direction.x;
+		DirectionY[slot] = ray.Direction.y;
+		DirectionZ[slot] = ray.Direction.z;
+		ThroughputR[slot] = throughput.r;
+		ThroughputG[slot] = throughput.g;
+		ThroughputB[slot] = throughput.b;
+		RadianceR[slot] = radiance.r;
+		RadianceG[slot] = radiance.g;
+		RadianceB[slot] = radiance.b;
+	}
+
+	Ray GetRay(uint32_t slot) const {
+		return Ray(glm::vec3(OriginX[slot], OriginY[slot], OriginZ[slot]), glm::vec3(DirectionX[slot], DirectionY[slot], DirectionZ[slot]));
+	}
+	glm::vec3 GetThroughput(uint32_t slot) const { return glm::vec3(ThroughputR[slot], ThroughputG[slot], ThroughputB[slot]); }
+	glm::vec3 GetRadiance(uint32_t slot) const { return glm::vec3(RadianceR[slot], RadianceG[slot], RadianceB[slot]); }
+	TLASHit GetHit(uint32_t slot) const {
+		TLASHit hit;
+		hit.Distance = HitDistance[slot];
+		hit.InstanceIndex = InstanceIndex[slot];
+		hit.TriangleIndex = TriangleIndex[slot];
+		hit.Barycentrics = glm::vec2(BarycentricU[slot], BarycentricV[slot]);
+		return hit;
+	}
+
+	// Copies the entries order[first, last) of source to the slots first to last.
+	void Gather(const RayQueue& source, const std::vector<uint32_t>& order, uint32_t first, uint32_t last) {
+		FloatComponents components = GetFloatComponents();
+		auto sourceComponents = source.GetFloatComponents();
+		for (uint32_t slot = first; slot < last; slot++)
+		{
+			uint32_t from = order[slot];
+			PathIndex[slot] = source.PathIndex[from];
+			InstanceIndex[slot] = source.InstanceIndex[from];
+			TriangleIndex[slot] = source.TriangleIndex[from];
+		}
+		for (size_t i = 0; i < components.size(); i++)
+		{
+			for (uint32_t slot = first; slot < last; slot++)
+				(*components[i])[slot] = (*sourceComponents[i])[order[slot]];
+		}
+	}
+
+	// Copies the path state, not the hit, of count entries of source from sourceFirst on to the
+	// slots from first on.
+	void CopyPaths(const RayQueue& source, uint32_t sourceFirst, uint32_t count, uint32_t first) {
+		FloatComponents components = GetFloatComponents();
+		auto sourceComponents = source.GetFloatComponents();
+		std::copy_n(source.PathIndex.begin() + sourceFirst, count, PathIndex.begin() + first);
+		for (size_t i = 0; i < PathComponentCount; i++)
+			std::copy_n(sourceComponents[i]->begin() + sourceFirst, count, components[i]->begin() + first);
+	}
+
+	// Exchanges the arrays but keeps the sizes, for swapping in a reordered copy.
+	void SwapEntries(RayQueue& other) {
+		FloatComponents components = GetFloatComponents();
+		FloatComponents otherComponents = other.GetFloatComponents();
+		for (size_t i = 0; i < components.size(); i++)
+			std::swap(*components[i], *otherComponents[i]);
+		std::swap(PathIndex, other.PathIndex);
+		std::swap(InstanceIndex, other.InstanceIndex);
+		std::swap(TriangleIndex, other.TriangleIndex);
+	}
+private:
+	using FloatComponents = std::array<std::vector<float>*, 15>;
+	// The float components of the ray and path state come first, the hit after them.
+	static constexpr size_t PathComponentCount = 12;
+
+	FloatComponents GetFloatComponents() {
+		return { &OriginX, &OriginY, &OriginZ, &DirectionX, &DirectionY, &DirectionZ,
+			&ThroughputR, &ThroughputG, &ThroughputB, &RadianceR, &RadianceG, &RadianceB, &HitDistance, &BarycentricU, &BarycentricV };
+	}
+	std::array<const std::vector<float>*, 15> GetFloatComponents() const {
+		return { &OriginX, &OriginY, &OriginZ, &DirectionX, &DirectionY, &DirectionZ,
+			&ThroughputR, &ThroughputG, &ThroughputB, &RadianceR, &RadianceG, &RadianceB, &HitDistance, &BarycentricU, &BarycentricV };
+	}
+};
+
+// Per pixel results of the wavefront integrator, one path per pixel and pass.
+struct PathResults {
+	std::vector<float> RadianceR, RadianceG, RadianceB;
+	std::vector<uint8_t> Active; // Pixels in converged blocks take no sample this pass
+
+	void Resize(uint32_t count) {
+		RadianceR.resize(count);
+		RadianceG.resize(count);
+		RadianceB.resize(count);
+		Active.resize(count);
+	}
+
+	glm::vec3 GetRadiance(uint32_t i) const { return glm::vec3(RadianceR[i], RadianceG[i], RadianceB[i]); }
+
+	void SetRadiance(uint32_t i, const glm::vec3& radiance) {
+		RadianceR[i] = radiance.r;
+		RadianceG[i] = radiance.g;
+		RadianceB[i] = radiance.b;
+	}
+};
@@ -0,0 +1,169 @@
+#include "WideBVH.h"
+#include "SIMD.h"
+#include "BVHTraversal.h"
+
+#include <algorithm>
+#include <limits>
+
+// Slab test against all children of a node. Writes the entry distance of every child and
+// returns a bit mask of the children hit in front of tMax.
+static inline uint32_t IntersectChildren(const WideBVHNode<4>& node, const Ray& ray, float tMax, float* distances) {
+	const __m128 originX = _mm_set1_ps(ray.Origin.x);
+	const __m128 originY = _mm_set1_ps(ray.Origin.y);
+	const __m128 originZ = _mm_set1_ps(ray.Origin.z);
+	const __m128 invDirectionX = _mm_set1_ps(ray.InvDirection.x);
+	const __m128 invDirectionY = _mm_set1_ps(ray.InvDirection.y);
+	const __m128 invDirectionZ = _mm_set1_ps(ray.InvDirection.z);
+
+	__m128 t1x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinX), originX), invDirectionX);
+	__m128 t2x = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxX), originX), invDirectionX);
+	__m128 t1y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinY), originY), invDirectionY);
+	__m128 t2y = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxY), originY), invDirectionY);
+	__m128 t1z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MinZ), originZ), invDirectionZ);
+	__m128 t2z = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.MaxZ), originZ), invDirectionZ);
+
+	__m128 tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+
+	// Ordered compares are false for the NaN bounds of unused slots.
+	__m128 hit = _mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps()));
+	hit = _mm_and_ps(hit, _mm_cmplt_ps(tNear, _mm_set1_ps(tMax)));
+
+	_mm_storeu_ps(distances, tNear);
+	return (uint32_t)_mm_movemask_ps(hit);
+}
+
+PT_TARGET_AVX2 static uint32_t IntersectChildren(const WideBVHNode<8>& node, const Ray& ray, float tMax, float* distances) {
+	const __m256 originX = _mm256_set1_ps(ray.Origin.x);
+	const __m256 originY = _mm256_set1_ps(ray.Origin.y);
+	const __m256 originZ = _mm256_set1_ps(ray.Origin.z);
+	const __m256 invDirectionX = _mm256_set1_ps(ray.InvDirection.x);
+	const __m256 invDirectionY = _mm256_set1_ps(ray.InvDirection.y);
+	const __m256 invDirectionZ = _mm256_set1_ps(ray.InvDirection.z);
+
+	__m256 t1x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinX), originX), invDirectionX);
+	__m256 t2x = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxX), originX), invDirectionX);
+	__m256 t1y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinY), originY), invDirectionY);
+	__m256 t2y = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxY), originY), invDirectionY);
+	__m256 t1z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MinZ), originZ), invDirectionZ);
+	__m256 t2z = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(node.MaxZ), originZ), invDirectionZ);
+
+	__m256 tNear = _mm256_max_ps(_mm256_max_ps(_mm256_min_ps(t1x, t2x), _mm256_min_ps(t1y, t2y)), _mm256_min_ps(t1z, t2z));
+	__m256 tFar = _mm256_min_ps(_mm256_min_ps(_mm256_max_ps(t1x, t2x), _mm256_max_ps(t1y, t2y)), _mm256_max_ps(t1z, t2z));
+
+	__m256 hit = _mm256_and_ps(_mm256_cmp_ps(tNear, tFar, _CMP_LE_OQ), _mm256_cmp_ps(tFar, _mm256_setzero_ps(), _CMP_GE_OQ));
+	hit = _mm256_and_ps(hit, _mm256_cmp_ps(tNear, _mm256_set1_ps(tMax), _CMP_LT_OQ));
+
+	_mm256_storeu_ps(distances, tNear);
+	return (uint32_t)_mm256_movemask_ps(hit);
+}
+
+template<uint32_t Width>
+void WideBVH<Width>::Build(const BVHNodeArray& binaryNodes) {
+	m_Nodes.clear();
+	if (binaryNodes.empty())
+		return;
+
+	// A binary BVH with n leaves collapses into at most n - 1 wide nodes.
+	m_Nodes.reserve(binaryNodes.size() / 2 + 1);
+	Collapse(binaryNodes, 0);
+	m_Nodes.shrink_to_fit();
+}
+
+template<uint32_t Width>
+uint32_t WideBVH<Width>::Collapse(const BVHNodeArray& binaryNodes, uint32_t binaryIndex) {
+	// Open the internal child with the largest surface area until the node is full, since
+	// it is the one most likely to be entered by a ray.
+	uint32_t children[Width];
+	uint32_t childCount = 0;
+	const BVHNode& root = binaryNodes[binaryIndex];
+	if (root.IsLeaf()) {
+		children[childCount++] = binaryIndex;
+	}
+	else {
+		children[childCount++] = root.LeftFirst;
+		children[childCount++] = root.LeftFirst + 1;
+	}
+	while (childCount < Width) {
+		int largest = -1;
+		float largestArea = -1.0f;
+		for (uint32_t i = 0; i < childCount; i++)
+		{
+			const BVHNode& child = binaryNodes[children[i]];
+			if (!child.IsLeaf() && child.BoundingBox.SurfaceArea() > largestArea) {
+				largestArea = child.BoundingBox.SurfaceArea();
+				largest = i;
+			}
+		}
+		if (largest < 0)
+			break;
+
+		uint32_t leftFirst = binaryNodes[children[largest]].LeftFirst;
+		children[largest] = leftFirst;
+		children[childCount++] = leftFirst + 1;
+	}
+
+	uint32_t nodeIndex = (uint32_t)m_Nodes.size();
+	m_Nodes.emplace_back();
+	{
+		WideBVHNode<Width>& node = m_Nodes[nodeIndex];
+		const float nan = std::numeric_limits<float>::quiet_NaN();
+		std::fill(std::begin(node.MinX), std::end(node.MinX), nan);
+		std::fill(std::begin(node.MinY), std::end(node.MinY), nan);
+		std::fill(std::begin(node.MinZ), std::end(node.MinZ), nan);
+		std::fill(std::begin(node.MaxX), std::end(node.MaxX), nan);
+		std::fill(std::begin(node.MaxY), std::end(node.MaxY), nan);
+		std::fill(std::begin(node.MaxZ), std::end(node.MaxZ), nan);
+		std::fill(std::begin(node.Child), std::end(node.Child), 0);
+		std::fill(std::begin(node.Count), std::end(node.Count), 0);
+	}
+
+	for (uint32_t i = 0; i < childCount; i++)
+	{
+		const BVHNode& child = binaryNodes[children[i]];
+		uint32_t childIndex = child.IsLeaf() ? child.LeftFirst : Collapse(binaryNodes, children[i]);
+
+		// Collapse may have grown the array, so look the node up again.
+		WideBVHNode<Width>& node = m_Nodes[nodeIndex];
+		node.MinX[i] = child.BoundingBox.Min.x;
+		node.MinY[i] = child.BoundingBox.Min.y;
+		node.MinZ[i] = child.BoundingBox.Min.z;
+		node.MaxX[i] = child.BoundingBox.Max.x;
+		node.MaxY[i] = child.BoundingBox.Max.y;
+		node.MaxZ[i] = child.BoundingBox.Max.z;
+		node.Child[i] = childIndex;
+		node.Count[i] = child.IsLeaf() ? child.TriangleCount : 0;
+	}
+	return nodeIndex;
+}
+
+template<uint32_t Width>
+bool WideBVH<Width>::Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const {
+	bool hit = false;
+	TraverseWideBVH<Width>(m_Nodes, hitDistance,
+		[&](const WideBVHNode<Width>& node, float tMax, float* distances) {
+			return IntersectChildren(node, ray, tMax, distances);
+		},
+		[&](uint32_t first, uint32_t count) {
+			hit |= triangles.IntersectRange(first, count, ray, hitDistance, triangleIndex, barycentrics);
+			return false;
+		});
+	return hit;
+}
+
+template<uint32_t Width>
+bool WideBVH<Width>::Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const {
+	bool occluded = false;
+	TraverseWideBVH<Width>(m_Nodes, tMax,
+		[&](const WideBVHNode<Width>& node, float maxDistance, float* distances) {
+			return IntersectChildren(node, ray, maxDistance, distances);
+		},
+		[&](uint32_t first, uint32_t count) {
+			occluded = triangles.OccludedRange(first, count, ray, tMax);
+			return occluded;
+		});
+	return occluded;
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
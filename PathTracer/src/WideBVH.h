@@ -0,0 +1,51 @@
+#pragma once
+
+#include "BVHNode.h"
+#include "Triangle.h"
+#include "Ray.h"
+
+#include <vector>
+
+enum class BVHLayout {
+	Binary,
+	Wide4, // SSE
+	Wide8  // AVX2, falls back to Wide4 on CPUs without it
+};
+
+// Node with Width children. The child bounds are stored per axis so one SIMD slab test
+// covers all of them. Unused slots have NaN bounds, which never report a hit.
+template<uint32_t Width>
+struct alignas(32) WideBVHNode {
+	float MinX[Width];
+	float MinY[Width];
+	float MinZ[Width];
+	float MaxX[Width];
+	float MaxY[Width];
+	float MaxZ[Width];
+	uint32_t Child[Width]; // Wide node index, or the first triangle of a leaf child
+	uint32_t Count[Width]; // Triangles in a leaf child, 0 for internal children
+};
+
+// BVH4 / BVH8 made by collapsing the binary BVH of a mesh. Leaves reference the same
+// triangle ranges as the binary tree they were built from.
+template<uint32_t Width>
+class WideBVH {
+public:
+	WideBVH() = default;
+
+	void Build(const BVHNodeArray& binaryNodes);
+
+	bool Intersect(const Ray& ray, const TriangleBuffer& triangles, float& hitDistance, uint32_t& triangleIndex, glm::vec2& barycentrics) const;
+	// True if any triangle is hit closer than tMax.
+	bool Occluded(const Ray& ray, const TriangleBuffer& triangles, float tMax) const;
+
+	const std::vector<WideBVHNode<Width>>& GetNodes() const { return m_Nodes; }
+	size_t GetMemoryUsage() const { return m_Nodes.capacity() * sizeof(WideBVHNode<Width>); }
+private:
+	uint32_t Collapse(const BVHNodeArray& binaryNodes, uint32_t binaryIndex);
+private:
+	std::vector<WideBVHNode<Width>> m_Nodes;
+};
+
+using BVH4 = WideBVH<4>;
+using BVH8 = WideBVH<8>;